@@ -15,6 +15,8 @@
 #define BUFSIZE 260
 #define TYPE(t) list_el(PieceType, bd->types, t)
 #define FRAG(t, f) list_el(u16, TYPE(t).frag, f)
+#define ZOB(t, loc) (bd->zob[(t)*bd->w*bd->h + (loc)])
+#define BITS(n) (((n) + 63) / 64)  // u64s for n bits
 
 /** Strip trailing whitespace
  */
@@ -101,6 +103,131 @@ static void free_PieceType(PieceType *pt)
 
 
 
+/** Set up the bitboards.  Only the walls and '-' are left in bd->grid
+ */
+static void make_bits(Board *bd)
+{
+    int t, d, i, c, ncells = bd->w * bd->h;
+
+    bd->nwords = BITS(ncells);
+    bd->small = (ncells <= 64);
+    bd->walls = calloc(bd->nwords, sizeof(u64));
+    bd->locked = calloc(bd->nwords, sizeof(u64));
+    bd->mask = calloc(bd->types.length * 5, sizeof(u64));
+    if(!bd->walls || !bd->locked || !bd->mask)
+	DIE("Out of memory for bitboards");
+    for(i=0; i < ncells; i++) {
+	if(bd->grid[i] == 0xFF)
+	    bd->walls[i >> 6] |= 1ULL << (i & 63);
+	else if(bd->grid[i] == 0x80)
+	    bd->locked[i >> 6] |= 1ULL << (i & 63);
+    }
+    // from bd->w before the piece the masks fit in a u64 on a small board
+    for(t=0; bd->small && t < bd->types.length; t++) {
+	for(d=0; d < 4; d++)
+	    for(i=0; i < TYPE(t).edge[d].length; i++) {
+		c = list_el(s16, TYPE(t).edge[d], i) + bd->w;
+		bd->mask[t*5 + d] |= 1ULL << c;
+	    }
+	for(i=0; i < TYPE(t).frag.length; i++)
+	    bd->mask[t*5 + BOARD_SHAPE] |= 1ULL << (FRAG(t, i) + bd->w);
+    }
+}
+
+/** Compile the types into flat tables for the hot paths, so nothing there
+ * goes through a List or looks for a piece's type
+ */
+static void make_tables(Board *bd)
+{
+    int i, t, d, f, n;
+    bd->ptype = safe_malloc(sizeof(u16) * bd->npcs);
+    bd->first = safe_malloc(sizeof(u16) * bd->npcs);
+    bd->last = safe_malloc(sizeof(u16) * bd->npcs);
+    for(i=0, t=0; i < bd->npcs; t += (i==TYPE(t).last), i++) {
+	bd->ptype[i] = t;
+	bd->first[i] = t ? TYPE(t-1).last + 1 : 0;
+	bd->last[i] = TYPE(t).last;
+    }
+    bd->edgeat = safe_malloc(sizeof(int) * (4*bd->types.length + 1));
+    for(t=0, n=0; t < bd->types.length; t++)
+	for(d=0; d < 4; d++)
+	    n += TYPE(t).edge[d].length;
+    bd->edges = safe_malloc(sizeof(s16) * n);
+    for(t=0, n=0; t < bd->types.length; t++)
+	for(d=0; d < 4; d++) { // edges are in cell order
+	    bd->edgeat[t*4 + d] = n;
+	    for(f=0; f < TYPE(t).edge[d].length; f++)
+		bd->edges[n++] = list_el(s16, TYPE(t).edge[d], f);
+	}
+    bd->edgeat[t*4] = n;
+    bd->fragat = safe_malloc(sizeof(int) * (bd->types.length + 1));
+    for(t=0, n=0; t < bd->types.length; t++)
+	n += TYPE(t).frag.length;
+    bd->frags = safe_malloc(sizeof(u16) * n);
+    for(t=0, n=0; t < bd->types.length; t++) {
+	bd->fragat[t] = n;
+	for(f=0; f < TYPE(t).frag.length; f++)
+	    bd->frags[n++] = FRAG(t, f);
+    }
+    bd->fragat[t] = n;
+}
+
+/** Cell \a c flipped left to right
+ */
+static inline int mirror_cell(Board *bd, int c)
+{
+    return c - c % bd->w + bd->w-1 - c % bd->w;
+}
+
+/** Is the board its own mirror image?  The walls, the '-' cells and the goal
+ * have to be, and so does the shape of every type (a type that mirrors
+ * into another one doesn't count).  If so fill in bd->mloc.
+ */
+static void make_mirror(Board *bd)
+{
+    int t, f, i, c, n, ncells = bd->w * bd->h;
+    u16 *cells;
+
+    bd->sym = 0;
+    bd->mloc = NULL;
+    for(c=0; c < ncells; c++)
+	if(bits_get(bd->walls, c) != bits_get(bd->walls, mirror_cell(bd, c)) ||
+		bits_get(bd->locked, c) != bits_get(bd->locked, mirror_cell(bd, c)))
+	    return;
+    cells = safe_malloc(sizeof(u16) * ncells);
+    for(t=0; t < bd->types.length; t++) {
+	// flip a piece where it starts and put its cells back in order
+	n = bd->fragat[t+1] - bd->fragat[t];
+	for(f=0; f < n; f++) {
+	    c = mirror_cell(bd, bd->pcs[TYPE(t).last] + bd->frags[bd->fragat[t] + f]);
+	    for(i=f; i > 0 && cells[i-1] > c; i--)
+		cells[i] = cells[i-1];
+	    cells[i] = c;
+	}
+	for(f=0; f < n && cells[f] - cells[0] == bd->frags[bd->fragat[t] + f]; f++);
+	if(f < n) {
+	    free(cells);
+	    return;
+	}
+    }
+    free(cells);
+    bd->mloc = safe_malloc(sizeof(u16) * bd->types.length * ncells);
+    for(t=0; t < bd->types.length; t++)
+	for(i=0; i < ncells; i++) {
+	    // the first cell of the flipped piece (past the end it can't be there anyway)
+	    bd->mloc[t*ncells + i] = ncells;
+	    for(f=bd->fragat[t]; f < bd->fragat[t+1] && i + bd->frags[f] < ncells; f++)
+		if(mirror_cell(bd, i + bd->frags[f]) < bd->mloc[t*ncells + i])
+		    bd->mloc[t*ncells + i] = mirror_cell(bd, i + bd->frags[f]);
+	}
+    if(bd->mloc[bd->end] != bd->end) {
+	free(bd->mloc);
+	bd->mloc = NULL;
+	return;
+    }
+    bd->sym = 1;
+}
+
 /** Make sure bd is freed before it is inited
  * File format is
  * 1: <width> <height> <endpos>
@@ -195,6 +322,20 @@ void board_init(Board *bd, FILE *stream)
     for(i=0; i < bd->npcs; i++)
 	bd->pcs[i] = PCS(i).loc;
 
+    // Zobrist keys (splitmix64 so every run hashes the same)
+    u64 z = 0x2545F4914F6CDD1DULL;
+    bd->zob = safe_malloc(sizeof(u64) * bd->types.length * bd->w * bd->h);
+    for(i=0; i < bd->types.length * bd->w * bd->h; i++) {
+	u64 x = (z += 0x9E3779B97F4A7C15ULL);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	bd->zob[i] = x ^ (x >> 31);
+    }
+
+    make_bits(bd);
+    make_tables(bd);
+    make_mirror(bd);
+
     // cleanup
     #undef PCS
     list_fini(&pcs);
@@ -208,65 +349,68 @@ void board_fini(Board *bd)
     int i;
     safe_free(bd->grid);
     safe_free(bd->pcs);
+    safe_free(bd->zob);
+    safe_free(bd->walls);
+    safe_free(bd->locked);
+    safe_free(bd->mask);
+    safe_free(bd->ptype);
+    safe_free(bd->first);
+    safe_free(bd->mloc);
+    safe_free(bd->last);
+    safe_free(bd->edges);
+    safe_free(bd->edgeat);
+    safe_free(bd->frags);
+    safe_free(bd->fragat);
     safe_free(bd->name);
     for(i=0; i < bd->types.length; i++)
 	free_PieceType(&TYPE(i));
     list_fini(&bd->types);
 }
 
-/** Check to see if a piece of @a type at @a loc on @a grid
- *  can move in some @a dir
- */
-int board_can_move(Board *bd, u8 *grid, int type, u16 loc, int dir)
-{
-    int i, delta;
-    for(i=0; i < TYPE(type).edge[dir].length; i++) {
-	delta = list_el(s16, TYPE(type).edge[dir], i);
-	if(grid[loc + delta] && !(type==0 && grid[loc+delta]==0x80))
-	    return 0;
-    }
-    return 1;
-}
-
 void board_assert_sorted(Board *bd, u16 *pcs)
 {
-    int i,  t;
-    for(i=0, t=0; i < bd->npcs; t += (i==TYPE(t).last), i++) {
-	if(i != TYPE(t).last && pcs[i] > pcs[i+1])
+    int i;
+    for(i=0; i < bd->npcs-1; i++)
+	if(i != bd->last[i] && pcs[i] > pcs[i+1])
 	    DIE("not sorted");
-    }
-
-
 }
 
-/**
- * apply the move (fs->ipcd, fs->dir) to fs->pcs
+/** Zobrist hash of \a pcs.  It only depends on which cells each type
+ * covers, not on the order of the pieces.
  */
-void board_apply_move(Board *bd, u16 *pcs, int ipcs, int dir)
+u64 board_hash(Board *bd, u16 *pcs)
 {
-    int j, i, t;
-    // find type
-    for(t=0; t < bd->types.length; t++)
-	if(ipcs <= TYPE(t).last)
-	    break;
+    int i;
+    u64 h = 0;
+    for(i=0; i < bd->npcs; i++)
+	h ^= ZOB(bd->ptype[i], pcs[i]);
+    return h;
+}
 
-    j = i = ipcs;
-    u16 tmp = pcs[i] + bd->dir[dir];
-    // resort
-    if(j > 0) { // the first one never needs sorting
-	// move it right
-	while(j <  TYPE(t).last && tmp > pcs[j+1]) {
-	    pcs[j] = pcs[j+1];
-	    j++;
-	}
-	// move it left
-	while(j > TYPE(t-1).last + 1 && tmp < pcs[j-1]) {
+/** Flip \a pcs left to right (in place).  bd->sym only
+ */
+void board_mirror(Board *bd, u16 *pcs)
+{
+    int i, j, ncells = bd->w * bd->h;
+    u16 tmp;
+    for(i=0; i < bd->npcs; i++) {
+	// a row comes out backwards, so keep every type sorted as we go
+	tmp = bd->mloc[bd->ptype[i]*ncells + pcs[i]];
+	for(j=i; j > bd->first[i] && pcs[j-1] > tmp; j--)
 	    pcs[j] = pcs[j-1];
-	    j--;
-	}
+	pcs[j] = tmp;
     }
-    pcs[j] = tmp;
+}
 
+/** board_hash of the mirror image of \a pcs.  bd->sym only
+ */
+u64 board_mirror_hash(Board *bd, u16 *pcs)
+{
+    int i, ncells = bd->w * bd->h;
+    u64 h = 0;
+    for(i=0; i < bd->npcs; i++)
+	h ^= ZOB(bd->ptype[i], bd->mloc[bd->ptype[i]*ncells + pcs[i]]);
+    return h;
 }
 
 /** Put all the @a pcs into @a grid
@@ -275,11 +419,29 @@ void board_fill(Board *bd, u16 *pcs, u8 *grid)
 {
     int i, f, t;
     memcpy(grid, bd->grid, bd->w * bd->h);
-    for(i=0, t=0; i < bd->npcs; t += (i==TYPE(t).last), i++) {
+    for(i=0; i < bd->npcs; i++) {
 	// add each fragment of this piece
-	for(f=0; f < TYPE(t).frag.length; f++)
-	    grid[FRAG(t,f) + pcs[i]] = i+1;
+	t = bd->ptype[i];
+	for(f=bd->fragat[t]; f < bd->fragat[t+1]; f++)
+	    grid[bd->frags[f] + pcs[i]] = i+1;
+    }
+}
+
+/** The spaces (cells not in \a occ, '-' included) in \a sps, smallest
+ * first.  Only the set bits get looked at.  Returns how many (bd->nsp)
+ */
+int board_spaces(Board *bd, u64 *occ, u16 *sps)
+{
+    int w, n = 0, ncells = bd->w * bd->h;
+    u64 spaces;
+    for(w=0; w*64 < ncells; w++) {
+	spaces = ~occ[w];
+	if(ncells - w*64 < 64)
+	    spaces &= (1ULL << (ncells - w*64)) - 1;
+	for(; spaces; spaces &= spaces - 1)
+	    sps[n++] = w*64 + __builtin_ctzll(spaces);
     }
+    return n;
 }
 
 void board_debug_state(Board *bd, u16 *pcs)
@@ -1,6 +1,7 @@
 #ifndef BOARD_H
 #define BOARD_H
 
+#include <string.h>
 #include "types.h"
 #include "list.h"
 
@@ -9,6 +10,8 @@
 #define DIR_S  2
 #define DIR_W  3
 
+#define BOARD_SHAPE 4  // bd->mask of the fragments (after the 4 edges)
+
 struct s_PieceType {
     List frag;    // type:u16 fragments of piece
     List edge[4]; // type:s16 piece edges, test locations 
@@ -23,14 +26,98 @@ struct s_Board {
     u16 end;        // position for end condition
     u8 *grid;       // blank grid with just walls
     u16 *pcs;      // initial state size=npcs
+    u64 *zob;      // Zobrist keys, one per (type, location)
+    // bitboards: bit i is cell i
+    int nwords;     // u64s in a bitboard
+    int small;      // the board fits in one u64
+    u64 *walls;     // bitboard of the walls
+    u64 *locked;    // cells only the main piece can go in ('-')
+    u64 *mask;      // [type][dir or BOARD_SHAPE] cells for a piece at bd->w (small only)
+    // the types compiled to flat tables (the Lists are only for parsing)
+    u16 *ptype;     // type of each piece
+    u16 *first, *last; // first and last piece of each piece's type
+    s16 *edges;     // edges of every type, [type][dir]'s from edgeat[t*4+dir] to the next
+    int *edgeat;
+    u16 *frags;     // fragments of every type, type t's from fragat[t] to fragat[t+1]
+    int *fragat;
+    // left-right symmetry
+    int sym;        // the board, the goal and every type are their own mirror image
+    u16 *mloc;      // [type][loc] where a piece at loc is in the mirror image (sym only)
 };
 
+static inline int bits_get(u64 *bits, int i)
+{
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+/** Can a piece of \a type at \a loc move in \a dir on the board_occupy
+ * bitboard \a occ?  Its edge that way has to be clear.  On a small board
+ * that is one AND, otherwise a look at every cell of the edge.
+ * \a small is bd->small (a constant lets the compiler drop the other case)
+ */
+static inline int board_can_move(Board *bd, u64 *occ, int type, u16 loc, int dir, const int small)
+{
+    int i, c;
+    if(small)
+	return !((bd->mask[type*5 + dir] << (loc - bd->w)) & (occ[0] | (type ? bd->locked[0] : 0)));
+    for(i=bd->edgeat[type*4 + dir]; i < bd->edgeat[type*4 + dir + 1]; i++) {
+	c = loc + bd->edges[i];
+	if(bits_get(occ, c) || (type && bits_get(bd->locked, c)))
+	    return 0;
+    }
+    return 1;
+}
+
+/** The walls and all the \a pcs as a bitboard (bd->nwords of \a occ).
+ * \a small is bd->small
+ */
+static inline void board_occupy(Board *bd, u16 *pcs, u64 *occ, const int small)
+{
+    int i, f, c;
+    if(small) {
+	u64 o = bd->walls[0];
+	for(i=0; i < bd->npcs; i++)
+	    o |= bd->mask[bd->ptype[i]*5 + BOARD_SHAPE] << (pcs[i] - bd->w);
+	occ[0] = o;
+	return;
+    }
+    memcpy(occ, bd->walls, sizeof(u64) * bd->nwords);
+    for(i=0; i < bd->npcs; i++)
+	for(f=bd->fragat[bd->ptype[i]]; f < bd->fragat[bd->ptype[i]+1]; f++) {
+	    c = pcs[i] + bd->frags[f];
+	    occ[c >> 6] |= 1ULL << (c & 63);
+	}
+}
+
+/**
+ * apply the move (fs->ipcd, fs->dir) to fs->pcs
+ * Returns what it did to the hash. (xor it in)
+ */
+static inline u64 board_apply_move(Board *bd, u16 *pcs, int ipcs, int dir)
+{
+    int j = ipcs, t = bd->ptype[ipcs];
+    u16 tmp = pcs[j] + bd->dir[dir];
+    // resort within the type
+    while(j < bd->last[ipcs] && tmp > pcs[j+1]) { // move it right
+	pcs[j] = pcs[j+1];
+	j++;
+    }
+    while(j > bd->first[ipcs] && tmp < pcs[j-1]) { // move it left
+	pcs[j] = pcs[j-1];
+	j--;
+    }
+    pcs[j] = tmp;
+    return bd->zob[t*bd->w*bd->h + tmp] ^ bd->zob[t*bd->w*bd->h + tmp - bd->dir[dir]];
+}
+
 void board_init(Board *bd, FILE *stream);
 void board_fini(Board *bd);
 void board_fill(Board *bd, u16 *pcs, u8 *grid);
-int board_can_move(Board *bd, u8 *grid, int type, u16 loc, int dir);
+int board_spaces(Board *bd, u64 *occ, u16 *sps);
 void board_assert_sorted(Board *bd, u16 *pcs);
-void board_apply_move(Board *bd, u16 *pcs, int ipcs, int dir);
+u64 board_hash(Board *bd, u16 *pcs);
+void board_mirror(Board *bd, u16 *pcs);
+u64 board_mirror_hash(Board *bd, u16 *pcs);
 void board_debug_state(Board *bd, u16 *pcs);
 
 #endif
@@ -0,0 +1,264 @@
+/**
+ * Threading notes
+ *   1) init/fini are not thread-safe
+ *   2) pack/unpack are safe
+ */
+#include <string.h>
+#include "base.h"
+#include "codec.h"
+
+#define TYPE(t) list_el(PieceType, bd->types, t)
+#define FRAG(t, f) list_el(u16, TYPE(t).frag, f)
+#define BINOM(c, n, k) ((c)->binom[(n)*((c)->maxk+1) + (k)])
+#define SAT (~0ULL)
+
+/** Bits needed to count to n-1
+ */
+static int nbits(unsigned long long n)
+{
+    int b = 0;
+    while(b < 64 && (n-1) >> b)
+	b++;
+    return b;
+}
+
+/** Can a piece of type t sit at loc?
+ */
+static int can_sit(Board *bd, int t, int loc)
+{
+    int f, g;
+    for(f=0; f < TYPE(t).frag.length; f++) {
+	if(loc + FRAG(t,f) >= bd->w * bd->h)
+	    return 0;
+	g = bd->grid[loc + FRAG(t,f)];
+	if(g && !(t == 0 && g == 0x80)) // only the main piece goes on '-'
+	    return 0;
+    }
+    return 1;
+}
+
+void codec_init(Codec *c, Board *bd)
+{
+    int t, loc, n, k, maxn = 0;
+    CodecType *ct;
+
+    memset(c, 0, sizeof(Codec));
+    c->ntypes = bd->types.length;
+    c->size = bd->w * bd->h;
+    c->types = safe_malloc(sizeof(CodecType) * c->ntypes);
+    c->cellidx = safe_malloc(sizeof(s16) * c->ntypes * c->size);
+
+    // where can each type go
+    for(t=0; t < c->ntypes; t++) {
+	ct = &c->types[t];
+	ct->first = t ? TYPE(t-1).last + 1 : 0;
+	ct->k = TYPE(t).last + 1 - ct->first;
+	ct->cells = safe_malloc(sizeof(u16) * c->size);
+	ct->ncells = 0;
+	for(loc=0; loc < c->size; loc++) {
+	    c->cellidx[t*c->size + loc] = -1;
+	    if(can_sit(bd, t, loc)) {
+		c->cellidx[t*c->size + loc] = ct->ncells;
+		ct->cells[ct->ncells++] = loc;
+	    }
+	}
+	if(ct->ncells > maxn)
+	    maxn = ct->ncells;
+	if(ct->k > c->maxk)
+	    c->maxk = ct->k;
+    }
+
+    // Pascal's triangle, saturated
+    c->binom = safe_malloc(sizeof(unsigned long long) * (maxn+1) * (c->maxk+1));
+    for(n=0; n <= maxn; n++) {
+	for(k=0; k <= c->maxk; k++) {
+	    if(k == 0)
+		BINOM(c,n,k) = 1;
+	    else if(n == 0)
+		BINOM(c,n,k) = 0;
+	    else if(BINOM(c,n-1,k-1) == SAT || SAT - BINOM(c,n-1,k-1) < BINOM(c,n-1,k))
+		BINOM(c,n,k) = SAT;
+	    else
+		BINOM(c,n,k) = BINOM(c,n-1,k-1) + BINOM(c,n-1,k);
+	}
+    }
+
+    // how many bits each type takes
+    c->total = 1;
+    for(t=0; t < c->ntypes; t++) {
+	ct = &c->types[t];
+	ct->pbits = nbits(ct->ncells);
+	ct->ranked = BINOM(c, ct->ncells, ct->k) <= (1ULL << 63);
+	ct->bits = ct->ranked ? nbits(BINOM(c, ct->ncells, ct->k)) : ct->k * ct->pbits;
+	c->bits += ct->bits;
+	if(!ct->ranked || (c->total && BINOM(c, ct->ncells, ct->k) > (1ULL << 63) / c->total))
+	    c->total = 0;
+	else
+	    c->total *= BINOM(c, ct->ncells, ct->k);
+    }
+    c->nbytes = (c->bits + 7) / 8;
+}
+
+void codec_fini(Codec *c)
+{
+    int t;
+    for(t=0; t < c->ntypes; t++)
+	free(c->types[t].cells);
+    free(c->types);
+    free(c->cellidx);
+    free(c->binom);
+}
+
+/** Append the low \a n bits of \a v at bit \a *pos.  \a buf must start zeroed
+ */
+static inline void put_bits(u8 *buf, int *pos, unsigned long long v, int n)
+{
+    while(n > 0) {
+	int off = *pos & 7, take = (8 - off < n) ? 8 - off : n;
+	buf[*pos >> 3] |= (u8)((v & ((1u << take) - 1)) << off);
+	v >>= take;
+	n -= take;
+	*pos += take;
+    }
+}
+
+static inline unsigned long long get_bits(u8 *buf, int *pos, int n)
+{
+    unsigned long long v = 0;
+    int got = 0;
+    while(got < n) {
+	int off = *pos & 7, take = (8 - off < n - got) ? 8 - off : n - got;
+	v |= (unsigned long long)((buf[*pos >> 3] >> off) & ((1u << take) - 1)) << got;
+	got += take;
+	*pos += take;
+    }
+    return v;
+}
+
+/** Rank of the pieces of type \a t among all placements of that type
+ */
+static inline unsigned long long type_rank(Codec *c, int t, u16 *pcs)
+{
+    int j, i;
+    unsigned long long rank = 0;
+    CodecType *ct = &c->types[t];
+    for(j=0; j < ct->k; j++) {
+	i = c->cellidx[t*c->size + pcs[ct->first + j]];
+	ASSERT(i >= 0, "piece %d can't be at %d", ct->first + j, pcs[ct->first + j]);
+	rank += BINOM(c, i, j+1);
+    }
+    return rank;
+}
+
+static inline void type_unrank(Codec *c, int t, unsigned long long rank, u16 *pcs)
+{
+    int j, i;
+    CodecType *ct = &c->types[t];
+    // greedily take the largest C(i, j+1) that fits from the top down
+    for(j=ct->k-1, i=ct->ncells-1; j >= 0; j--, i--) {
+	while(BINOM(c, i, j+1) > rank)
+	    i--;
+	rank -= BINOM(c, i, j+1);
+	pcs[ct->first + j] = ct->cells[i];
+    }
+}
+
+/** Pack \a pcs (sorted within each type) into c->nbytes at \a out
+ */
+void codec_pack(Codec *c, u16 *pcs, u8 *out)
+{
+    int t, j, pos = 0;
+    CodecType *ct;
+
+    memset(out, 0, c->nbytes);
+    for(t=0; t < c->ntypes; t++) {
+	ct = &c->types[t];
+	if(ct->ranked) {
+	    put_bits(out, &pos, type_rank(c, t, pcs), ct->bits);
+	    continue;
+	}
+	for(j=0; j < ct->k; j++)
+	    put_bits(out, &pos, c->cellidx[t*c->size + pcs[ct->first + j]], ct->pbits);
+    }
+}
+
+void codec_unpack(Codec *c, u8 *in, u16 *pcs)
+{
+    int t, j, pos = 0;
+    CodecType *ct;
+
+    for(t=0; t < c->ntypes; t++) {
+	ct = &c->types[t];
+	if(ct->ranked) {
+	    type_unrank(c, t, get_bits(in, &pos, ct->bits), pcs);
+	    continue;
+	}
+	for(j=0; j < ct->k; j++)
+	    pcs[ct->first + j] = ct->cells[get_bits(in, &pos, ct->pbits)];
+    }
+}
+
+/** A perfect hash of \a pcs into [0, c->total).  Only if c->total != 0
+ * The type ranks are digits of a mixed radix number.
+ */
+unsigned long long codec_rank(Codec *c, u16 *pcs)
+{
+    int t;
+    unsigned long long rank = 0;
+    for(t=c->ntypes-1; t >= 0; t--)
+	rank = rank * BINOM(c, c->types[t].ncells, c->types[t].k) + type_rank(c, t, pcs);
+    return rank;
+}
+
+void codec_unrank(Codec *c, unsigned long long rank, u16 *pcs)
+{
+    int t;
+    unsigned long long radix;
+    for(t=0; t < c->ntypes; t++) {
+	radix = BINOM(c, c->types[t].ncells, c->types[t].k);
+	type_unrank(c, t, rank % radix, pcs);
+	rank /= radix;
+    }
+}
+
+/** Round trip the start and every state one move from it
+ */
+int codec_test(Board *bd)
+{
+    int i, t, d, e = 0;
+    Codec c;
+    u16 *pcs = safe_malloc(2*bd->npcs), *out = safe_malloc(2*bd->npcs);
+    u8 *buf;
+    u64 *occ = safe_malloc(sizeof(u64) * bd->nwords);
+
+    codec_init(&c, bd);
+    buf = safe_malloc(c.nbytes);
+    board_occupy(bd, bd->pcs, occ, bd->small);
+    for(i=-1, t=0; i < bd->npcs; i++) {
+	if(i > 0 && i > TYPE(t).last)
+	    t++;
+	for(d=0; d < 4; d++) {
+	    memcpy(pcs, bd->pcs, 2*bd->npcs);
+	    if(i >= 0) {
+		if(!board_can_move(bd, occ, t, pcs[i], d, bd->small))
+		    continue;
+		board_apply_move(bd, pcs, i, d);
+	    }
+	    codec_pack(&c, pcs, buf);
+	    codec_unpack(&c, buf, out);
+	    if(memcmp(pcs, out, 2*bd->npcs))
+		e |= 1;
+	    if(c.total) {
+		codec_unrank(&c, codec_rank(&c, pcs), out);
+		if(memcmp(pcs, out, 2*bd->npcs))
+		    e |= 2;
+	    }
+	}
+    }
+    free(buf);
+    free(occ);
+    free(pcs);
+    free(out);
+    codec_fini(&c);
+    return e;
+}
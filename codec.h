@@ -0,0 +1,45 @@
+/** \file codec.h
+ * Packs a sorted pcs array into as few bits as we can.
+ *
+ * Pieces of one type are interchangeable and kept sorted, so their
+ * positions are a k-subset of the cells that type can sit on.  That subset
+ * gets ranked with the combinatorial number system, taking
+ * ceil(log2(C(ncells, k))) bits.  When the rank does not fit in 64 bits the
+ * type falls back to storing every piece's cell index.
+ */
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "types.h"
+#include "board.h"
+
+typedef struct {
+    int first, k;     // the type's pieces are pcs[first..first+k)
+    int ncells;       // number of places the type can sit
+    u16 *cells;       // those places, sorted
+    int bits;         // bits the type takes in the packed state
+    int ranked;       // combinatorial rank (else pbits per piece)
+    int pbits;        // bits per piece if not ranked
+} CodecType;
+
+typedef struct {
+    int ntypes;
+    CodecType *types;
+    s16 *cellidx;     // location -> index into cells (per type, ntypes*w*h)
+    int size;         // w*h
+    int bits;         // total bits in a packed state
+    int nbytes;       // bytes in a packed state
+    unsigned long long total; // number of ranks (0 if they don't fit in 64 bits)
+    int maxk;         // binom has maxk+1 columns
+    unsigned long long *binom; // binom[n*(maxk+1)+k] = C(n,k)
+} Codec;
+
+void codec_init(Codec *c, Board *bd);
+void codec_fini(Codec *c);
+void codec_pack(Codec *c, u16 *pcs, u8 *out);
+void codec_unpack(Codec *c, u8 *in, u16 *pcs);
+unsigned long long codec_rank(Codec *c, u16 *pcs);
+void codec_unrank(Codec *c, unsigned long long rank, u16 *pcs);
+int codec_test(Board *bd);
+
+#endif
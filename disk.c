@@ -0,0 +1,276 @@
+/**
+ * Threading notes
+ *   1) a stream or merge belongs to one thread
+ *   2) the rest keep no state
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "base.h"
+#include "disk.h"
+
+/** DISK_BLOCK rounded down to whole records
+ */
+static inline long block_size(int rsize)
+{
+    return DISK_BLOCK / rsize * rsize;
+}
+
+static void *disk_buf(long size)
+{
+    void *buf = malloc(size);
+    if(!buf)
+	DIE("Out of memory for a %ld byte stream buffer", size);
+    return buf;
+}
+
+static void read_all(int fd, void *buf, long len, off_t off)
+{
+    long n;
+    for(; len > 0; buf += n, len -= n, off += n)
+	if((n = pread(fd, buf, len, off)) <= 0)
+	    DIE("Short read at %lld", (long long)off);
+}
+
+static void write_all(int fd, const void *buf, long len)
+{
+    long n;
+    for(; len > 0; buf += n, len -= n)
+	if((n = write(fd, buf, len)) <= 0)
+	    DIE("Can't write (disk full?)");
+}
+
+/** Stream records [first, last) of \a path
+ */
+void din_open(DiskIn *in, const char *path, int rsize, u64 first, u64 last)
+{
+    if((in->fd = open(path, O_RDONLY)) < 0)
+	DIE("Can't open %s", path);
+    in->rsize = rsize;
+    in->buf = disk_buf(block_size(rsize));
+    in->len = in->pos = 0;
+    in->off = (off_t)first * rsize;
+    in->end = (off_t)last * rsize;
+    posix_fadvise(in->fd, in->off, in->end - in->off, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(in->fd, in->off, block_size(rsize), POSIX_FADV_WILLNEED);
+}
+
+/** The next record (only good until the next call) or NULL at the end
+ */
+u8 *din_next(DiskIn *in)
+{
+    u8 *rec;
+    if(in->pos == in->len) {
+	long n = block_size(in->rsize);
+	if(in->off >= in->end)
+	    return NULL;
+	if(n > in->end - in->off)
+	    n = in->end - in->off;
+	read_all(in->fd, in->buf, n, in->off);
+	// we have our copy.  Start on the next block while we use this one
+	posix_fadvise(in->fd, in->off, n, POSIX_FADV_DONTNEED);
+	in->off += n;
+	if(in->off < in->end)
+	    posix_fadvise(in->fd, in->off, block_size(in->rsize), POSIX_FADV_WILLNEED);
+	in->len = n;
+	in->pos = 0;
+    }
+    rec = (u8*)in->buf + in->pos;
+    in->pos += in->rsize;
+    return rec;
+}
+
+void din_close(DiskIn *in)
+{
+    close(in->fd);
+    free(in->buf);
+}
+
+void dout_open(DiskOut *out, const char *path, int rsize)
+{
+    if((out->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+	DIE("Can't create %s", path);
+    out->rsize = rsize;
+    out->buf = disk_buf(block_size(rsize));
+    out->len = 0;
+    out->off = 0;
+    out->n = 0;
+}
+
+/** Write out buf.  Its writeback starts now and we only wait for the block
+ * before it, which then leaves the page cache.
+ */
+static void dout_flush(DiskOut *out)
+{
+    off_t prev = out->off - block_size(out->rsize);
+    if(!out->len)
+	return;
+    write_all(out->fd, out->buf, out->len);
+    sync_file_range(out->fd, out->off, out->len, SYNC_FILE_RANGE_WRITE);
+    if(prev >= 0) {
+	sync_file_range(out->fd, prev, out->off - prev,
+		SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(out->fd, prev, out->off - prev, POSIX_FADV_DONTNEED);
+    }
+    out->off += out->len;
+    out->len = 0;
+}
+
+void dout_put(DiskOut *out, const void *rec)
+{
+    if(out->len == block_size(out->rsize))
+	dout_flush(out);
+    memcpy(out->buf + out->len, rec, out->rsize);
+    out->len += out->rsize;
+    out->n++;
+}
+
+void dout_close(DiskOut *out)
+{
+    dout_flush(out);
+    close(out->fd);
+    free(out->buf);
+}
+
+/** Number of records in \a path
+ */
+u64 disk_count(const char *path, int rsize)
+{
+    struct stat st;
+    if(stat(path, &st))
+	DIE("Can't stat %s", path);
+    return st.st_size / rsize;
+}
+
+/** Index of the first record in (sorted) \a path with a key >= \a key.
+ * A NULL key is before everything
+ */
+u64 disk_lower(const char *path, int rsize, int ksize, const u8 *key)
+{
+    u64 lo = 0, hi, mid;
+    u8 *rec = alloca(ksize);
+    int fd;
+    if(!key)
+	return 0;
+    hi = disk_count(path, rsize);
+    if((fd = open(path, O_RDONLY)) < 0)
+	DIE("Can't open %s", path);
+    while(lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	read_all(fd, rec, ksize, (off_t)mid * rsize);
+	if(memcmp(rec, key, ksize) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    close(fd);
+    return lo;
+}
+
+/** Read record \a i of \a path into \a rec
+ */
+void disk_read(const char *path, int rsize, u64 i, void *rec)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+	DIE("Can't open %s", path);
+    read_all(fd, rec, rsize, (off_t)i * rsize);
+    close(fd);
+}
+
+static int key_cmp(const void *a, const void *b, void *ksize)
+{
+    return memcmp(a, b, *(int*)ksize);
+}
+
+void disk_sort(u8 *recs, u64 n, int rsize, int ksize)
+{
+    qsort_r(recs, n, rsize, key_cmp, &ksize);
+}
+
+/** Drop all but the first of every run of equal keys in sorted \a recs.
+ * Returns how many are left
+ */
+u64 disk_uniq(u8 *recs, u64 n, int rsize, int ksize)
+{
+    u64 i, j;
+    for(i=1, j=1; i < n; i++) {
+	if(!memcmp(recs + i*rsize, recs + (j-1)*rsize, ksize))
+	    continue;
+	if(i != j)
+	    memcpy(recs + j*rsize, recs + i*rsize, rsize);
+	j++;
+    }
+    return n ? j : 0;
+}
+
+static inline int heap_less(DiskMerge *m, int a, int b)
+{
+    return memcmp(m->head[m->heap[a]], m->head[m->heap[b]], m->ksize) < 0;
+}
+
+static void heap_down(DiskMerge *m, int i)
+{
+    int c, t;
+    while((c = 2*i + 1) < m->nheap) {
+	if(c+1 < m->nheap && heap_less(m, c+1, c))
+	    c++;
+	if(!heap_less(m, c, i))
+	    break;
+	t = m->heap[i], m->heap[i] = m->heap[c], m->heap[c] = t;
+	i = c;
+    }
+}
+
+/** Merge the \a n open streams at \a in (all the same record size)
+ */
+void dmerge_init(DiskMerge *m, DiskIn *in, int n, int ksize)
+{
+    int i;
+    m->n = n;
+    m->ksize = ksize;
+    m->in = in;
+    m->head = safe_malloc(sizeof(u8*) * (n+1));
+    m->heap = safe_malloc(sizeof(int) * (n+1));
+    m->out = n ? safe_malloc(in[0].rsize) : NULL;
+    for(i=0, m->nheap=0; i < n; i++)
+	if((m->head[i] = din_next(&in[i])))
+	    m->heap[m->nheap++] = i;
+    for(i=m->nheap/2 - 1; i >= 0; i--)
+	heap_down(m, i);
+}
+
+/** The smallest record left (without taking it) or NULL
+ */
+u8 *dmerge_peek(DiskMerge *m)
+{
+    return m->nheap ? m->head[m->heap[0]] : NULL;
+}
+
+/** Take the smallest record left (only good until the next call)
+ */
+u8 *dmerge_next(DiskMerge *m)
+{
+    int s;
+    if(!m->nheap)
+	return NULL;
+    s = m->heap[0];
+    memcpy(m->out, m->head[s], m->in[s].rsize);
+    if(!(m->head[s] = din_next(&m->in[s])))
+	m->heap[0] = m->heap[--m->nheap];
+    heap_down(m, 0);
+    return m->out;
+}
+
+void dmerge_fini(DiskMerge *m)
+{
+    int i;
+    for(i=0; i < m->n; i++)
+	din_close(&m->in[i]);
+    free(m->head);
+    free(m->heap);
+    free(m->out);
+}
@@ -0,0 +1,64 @@
+/** \file disk.h
+ * Files of fixed size records for the external memory BFS (ENGINE_DISK).
+ *
+ * Files are only ever streamed, DISK_BLOCK bytes at a time.  While we work
+ * on one block the kernel reads the next one in (or writes the last one
+ * out) so a stream runs at the speed of the disk, and blocks we are done
+ * with are dropped from the page cache so the layers don't push out the
+ * memory we sort in.  Keys are the first ksize bytes of a record and sort
+ * with memcmp.
+ */
+#ifndef DISK_H
+#define DISK_H
+
+#include <sys/types.h>
+#include "types.h"
+
+#define DISK_BLOCK (4*1024*1024L) // bytes streamed at a time
+
+typedef struct {
+    int fd;
+    int rsize;
+    char *buf;
+    long len, pos;    // bytes in buf, next one we hand out
+    off_t off, end;   // where the next block starts, where we stop
+} DiskIn;
+
+typedef struct {
+    int fd;
+    int rsize;
+    char *buf;
+    long len;         // bytes in buf
+    off_t off;        // bytes written
+    u64 n;            // records put
+} DiskOut;
+
+/** K-way merge of sorted streams (a heap of their heads)
+ */
+typedef struct {
+    int n, ksize;
+    DiskIn *in;       // the streams (closed with the merge)
+    u8 **head;        // the next record of each (NULL when it ran out)
+    int *heap, nheap; // streams ordered by head
+    u8 *out;          // the record dmerge_next handed out
+} DiskMerge;
+
+void din_open(DiskIn *in, const char *path, int rsize, u64 first, u64 last);
+u8 *din_next(DiskIn *in);
+void din_close(DiskIn *in);
+void dout_open(DiskOut *out, const char *path, int rsize);
+void dout_put(DiskOut *out, const void *rec);
+void dout_close(DiskOut *out);
+
+u64 disk_count(const char *path, int rsize);
+u64 disk_lower(const char *path, int rsize, int ksize, const u8 *key);
+void disk_read(const char *path, int rsize, u64 i, void *rec);
+void disk_sort(u8 *recs, u64 n, int rsize, int ksize);
+u64 disk_uniq(u8 *recs, u64 n, int rsize, int ksize);
+
+void dmerge_init(DiskMerge *m, DiskIn *in, int n, int ksize);
+u8 *dmerge_peek(DiskMerge *m);
+u8 *dmerge_next(DiskMerge *m);
+void dmerge_fini(DiskMerge *m);
+
+#endif
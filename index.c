@@ -6,58 +6,220 @@
  */
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include "base.h"
 #include "index.h"
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-static inline IndexPtr alloc_BNode(Index *idx)
+#if FANOUT % 4
+#error FANOUT has to be a multiple of 4
+#endif
+
+/** Node \a ip, from the pools of its home
+ */
+static inline BNode *bnode(Index *idx, IndexPtr ip)
+{
+    if(idx->nhome == 1)
+	return (BNode*)bm_ref(&idx->nodes[0], ip);
+    return (BNode*)bm_ref(&idx->nodes[(ip-1) % idx->nhome], (ip-1) / idx->nhome + 1);
+}
+
+/** The StatePtrs that go with bnode(idx, ip)
+ */
+static inline StatePtr *bstates(Index *idx, IndexPtr ip)
+{
+    if(idx->nhome == 1)
+	return (StatePtr*)bm_ref(&idx->states[0], ip);
+    return (StatePtr*)bm_ref(&idx->states[(ip-1) % idx->nhome], (ip-1) / idx->nhome + 1);
+}
+
+/** Number of keys in \a n that are <= \a hv.  The keys are sorted and the
+ * empty ones are ~0 (which hv never is) so this is where hv goes.
+ */
+static inline int node_rank_scalar(BNode *n, HashVal hv)
+{
+    int i;
+    for(i=0; i < FANOUT && hv >= n->hv[i]; i++);
+    return i;
+}
+
+/** node_rank_scalar with a compare + movemask over the lanes.  SSE/AVX only
+ * compare signed so both sides get their top bit flipped.
+ */
+#if defined(__AVX2__) && !defined(WIDE) && FANOUT % 8 == 0
+#define NODE_SIMD "avx2"
+static inline int node_rank(BNode *n, HashVal hv)
+{
+    __m256i bias = _mm256_set1_epi32(0x80000000);
+    __m256i key = _mm256_xor_si256(_mm256_set1_epi32(hv), bias);
+    int i, gt = 0;
+    for(i=0; i < FANOUT; i += 8) {
+	__m256i v = _mm256_xor_si256(_mm256_load_si256((__m256i*)&n->hv[i]), bias);
+	gt += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, key))));
+    }
+    return FANOUT - gt;
+}
+#elif defined(__AVX2__) && defined(WIDE)
+#define NODE_SIMD "avx2"
+static inline int node_rank(BNode *n, HashVal hv)
+{
+    __m256i bias = _mm256_set1_epi64x(0x8000000000000000LL);
+    __m256i key = _mm256_xor_si256(_mm256_set1_epi64x(hv), bias);
+    int i, gt = 0;
+    for(i=0; i < FANOUT; i += 4) {
+	__m256i v = _mm256_xor_si256(_mm256_load_si256((__m256i*)&n->hv[i]), bias);
+	gt += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, key))));
+    }
+    return FANOUT - gt;
+}
+#elif defined(__SSE2__) && !defined(WIDE)
+#define NODE_SIMD "sse2"
+static inline int node_rank(BNode *n, HashVal hv)
+{
+    __m128i bias = _mm_set1_epi32(0x80000000);
+    __m128i key = _mm_xor_si128(_mm_set1_epi32(hv), bias);
+    int i, gt = 0;
+    for(i=0; i < FANOUT; i += 4) {
+	__m128i v = _mm_xor_si128(_mm_load_si128((__m128i*)&n->hv[i]), bias);
+	gt += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, key))));
+    }
+    return FANOUT - gt;
+}
+#else
+#define NODE_SIMD "scalar"
+#define node_rank node_rank_scalar
+#endif
+
+/** Home of btree \a ht
+ */
+static inline int tree_home(Index *idx, int ht)
+{
+    if(idx->nhome > 1)
+	return ht % idx->nhome;
+    return idx->home < 0 ? 0 : idx->home; // -1 only with a single NUMA home
+}
+
+/** A new node for btree \a ht.  nodes and states are parallel so they
+ * can't have per-thread chunks
+ */
+static inline IndexPtr alloc_BNode(Index *idx, int ht)
 {
-    IndexPtr iptr = bm_alloc(&idx->states);
-    if(!iptr)
-	DIE("Out of node space\n");
-    bm_alloc(&idx->nodes);
-    memset( ((BNode*)bm_ref(&idx->nodes, iptr))->hv, 0xFF, sizeof(HashVal)*FANOUT);
+    int h = idx->nhome > 1 ? ht % idx->nhome : 0;
+    IndexPtr iptr = bm_alloc(&idx->states[h]);
+    if(!iptr || !bm_alloc(&idx->nodes[h]))
+	DIE("Out of node space (memory budget)\n");
+    iptr = (iptr-1)*idx->nhome + h + 1;
+    memset(bnode(idx, iptr)->hv, 0xFF, sizeof(HashVal)*FANOUT);
     return iptr;
 }
 
-void index_init(Index *idx, Iint size)
+/** \a home puts the whole index on one NUMA home.  -1 spreads the btrees
+ * over all of them (if numa_init was called)
+ */
+void index_init(Index *idx, Iint size, int type, int home)
 {
     int i;
     if(size%FANOUT)
 	DIE("size must be a multiple of %d", FANOUT);
+
+    idx->type = type;
+    idx->home = home;
+    idx->nhome = (home < 0 && numa_nodes > 1) ? numa_nodes : 1;
+    if(type == INDEX_HASH) {
+	// round up to a power of two so probing can mask
+	for(idx->bits=1; idx->bits < 8*sizeof(Iint)-1 && ((Iint)1 << idx->bits) < size; idx->bits++);
+	idx->nslots = (Iint)1 << idx->bits;
+	idx->used = 0;
+	printf("Index size = " IFMT " (hash)\n", idx->nslots);
+	idx->slots = calloc(idx->nslots, sizeof(ISlot));
+	if(!idx->slots)
+	    DIE("No mem");
+	if(home < 0)
+	    numa_interleave(idx->slots, idx->nslots * sizeof(ISlot));
+	return;
+    }
 	
-    printf("Index size = %u\n", size);
-    bm_init(&idx->nodes, sizeof(BNode), size/FANOUT);
-    bm_init(&idx->states, sizeof(StatePtr)*FANOUT, size/FANOUT);
-    /* initilize each btree */
+    printf("Index size = " IFMT "\n", size);
+    for(i=0; i < idx->nhome; i++) {
+	// every home has to be able to hold all of it
+	bm_init(&idx->nodes[i], sizeof(BNode), size/FANOUT);
+	bm_init(&idx->states[i], sizeof(StatePtr)*FANOUT, size/FANOUT);
+	idx->nodes[i].home = idx->states[i].home = idx->nhome > 1 ? i : home;
+    }
+    /* initilize each btree (btree ht's root ends up at ht+1) */
     for(i=0; i < HASHTBLSIZE; i++) { 
 	pthread_rwlock_init(&idx->locks[i], NULL);
 	idx->version[i] = 0;
-	alloc_BNode(idx);
+	alloc_BNode(idx, i);
+    }
+}
+
+/** Empty \a idx (and give back its memory).  Nobody may be using it
+ */
+void index_clear(Index *idx)
+{
+    int i;
+    if(idx->type == INDEX_HASH) {
+	memset(idx->slots, 0, idx->nslots * sizeof(ISlot));
+	idx->used = 0;
+	return;
+    }
+    for(i=0; i < idx->nhome; i++) {
+	bm_clear(&idx->nodes[i]);
+	bm_clear(&idx->states[i]);
+    }
+    for(i=0; i < HASHTBLSIZE; i++) {
+	idx->version[i]++;
+	alloc_BNode(idx, i);
     }
 }
 
 void index_fini(Index *idx)
 {
     int i;
+    if(idx->type == INDEX_HASH) {
+	free(idx->slots);
+	idx->slots = 0;
+	return;
+    }
     for(i=0; i < HASHTBLSIZE; i++)
 	pthread_rwlock_destroy(&idx->locks[i]);
-    bm_fini(&idx->nodes);
-    bm_fini(&idx->states);
+    for(i=0; i < idx->nhome; i++) {
+	bm_fini(&idx->nodes[i]);
+	bm_fini(&idx->states[i]);
+    }
 }
 
-/** allocates a new BNode and returns an Iptr to it
+/** Bytes of index used per state
  */
-float index_mem(void)
+float index_mem(int type)
 {
+    if(type == INDEX_HASH)
+	return 2*sizeof(ISlot); // the table is sized for <= 50% load
     return sizeof(StatePtr) + sizeof(BNode) / (float)FANOUT;
 }
 
+/** Number of hash values in the index
+ */
+Iint index_used(Index *idx)
+{
+    int i;
+    Iint used = 0;
+    if(idx->type == INDEX_HASH)
+	return idx->used;
+    for(i=0; i < idx->nhome; i++)
+	used += bm_used(&idx->nodes[i]);
+    return used*FANOUT;
+}
+
 /** This tries to upgrade \a lock from RO to RW
  * If idx was modified in the meantime it returns 0 and the lock is unlocked
  */
 int index_upgrade_rwlock(Index *idx, int wr, int hashidx, pthread_rwlock_t *lock)
 {
-    if(wr) // we are already WR
+    if(wr || !lock) // we are already WR (or lockless)
 	return 1;
     
     u32 pversion = idx->version[hashidx]; // remember previous version
@@ -74,6 +236,107 @@ int index_upgrade_rwlock(Index *idx, int wr, int hashidx, pthread_rwlock_t *lock
     return 1;
 }
 
+/** Release the lock handed out by index_ref (if there is one)
+ */
+void index_unlock(pthread_rwlock_t *lock)
+{
+    if(lock)
+	pthread_rwlock_unlock(lock);
+}
+
+/** Where hv starts probing (a multiplicative hash)
+ */
+static inline Iint hash_slot(Index *idx, HashVal hv)
+{
+    return (Iint)(((unsigned long long)hv * 0x9E3779B97F4A7C15ULL) >> (64 - idx->bits));
+}
+
+/** INDEX_HASH version of index_ref.
+ * Linear probing from a multiplicative hash of hv.  An empty slot is
+ * claimed with a CAS on its hv, so the StatePtr returned is never moved.
+ * No locks are taken: *lock is NULL and the return is always 0 (RO).
+ * The caller must publish a new chain head with a CAS as well.
+ */
+static int hash_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock)
+{
+    Iint n, i = hash_slot(idx, hv);
+    HashVal h;
+    ISlot *s;
+
+    *lock = NULL;
+    for(n=0; n < idx->nslots; n++) {
+	s = &idx->slots[i];
+	h = __atomic_load_n(&s->hv, __ATOMIC_ACQUIRE);
+	if(h == 0) {
+	    if(__sync_bool_compare_and_swap(&s->hv, 0, hv)) {
+		__sync_fetch_and_add(&idx->used, 1);
+		*sout = &s->sp;
+		return 0;
+	    }
+	    h = __atomic_load_n(&s->hv, __ATOMIC_ACQUIRE); // lost the race
+	}
+	if(h == hv) {
+	    *sout = &s->sp;
+	    return 0;
+	}
+	i = (i+1) & (idx->nslots-1);
+    }
+    DIE("Index FULL");
+    return -1;
+}
+
+/** Start \a p off looking for \a hv: prefetch the btree root (or slot)
+ */
+void index_probe(Index *idx, IndexProbe *p, HashVal hv)
+{
+    p->hv = hv;
+    p->sp = NULL;
+    if(idx->type == INDEX_HASH) {
+	p->at = hash_slot(idx, hv) + 1;
+	__builtin_prefetch(&idx->slots[p->at-1]);
+	return;
+    }
+    p->at = hv % HASHTBLSIZE + 1;
+    __builtin_prefetch(bnode(idx, p->at));
+}
+
+/** Look at the node \a p is on and prefetch the one after it.
+ * Returns 0 once \a p is done (p->sp is set if hv was found)
+ */
+int index_step(Index *idx, IndexProbe *p)
+{
+    BNode *n;
+    IndexPtr ip = p->at;
+    int i, h;
+
+    if(!ip)
+	return 0;
+    p->at = 0;
+    if(idx->type == INDEX_HASH) {
+	ISlot *s = &idx->slots[ip-1];
+	HashVal hv = __atomic_load_n(&s->hv, __ATOMIC_ACQUIRE);
+	if(hv == p->hv)
+	    p->sp = &s->sp;
+	else if(hv) // keep probing
+	    __builtin_prefetch(&idx->slots[p->at = (ip & (idx->nslots-1)) + 1]);
+	return !!p->at;
+    }
+    // writers may be moving this node around under us, so don't trust a
+    // link to a node that hasn't been handed out
+    h = idx->nhome > 1 ? (ip-1) % idx->nhome : 0;
+    if((ip-1) / idx->nhome + 1 > __atomic_load_n(&idx->nodes[h].brk, __ATOMIC_ACQUIRE))
+	return 0;
+    n = bnode(idx, ip);
+    i = node_rank(n, p->hv);
+    if(i && n->hv[i-1] == p->hv) {
+	p->sp = bstates(idx, ip) + i-1;
+	__builtin_prefetch(p->sp);
+    } else if(i < FANOUT && (p->at = n->ln[i])) {
+	__builtin_prefetch(bnode(idx, p->at));
+    }
+    return !!p->at;
+}
+
 /**
  * Search the index for hv.  If an existing entry exists return a pointer to it.
  * Otherwise, create a new entry and return a pointer to it. (*ptr will == 0)
@@ -95,8 +358,15 @@ int index_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock)
     u32 ht = hv % HASHTBLSIZE;
     IndexPtr maxip=0;
     IndexPtr ip = ht + 1; // this is our starting node index
+    StatePtr carry = 0; // state of the hv we are carrying down
     int i;
 
+    if(idx->type == INDEX_HASH)
+	return hash_ref(idx, hv, sout, lock);
+
+    if(numa_here >= 0) // for the cross-node report
+	numa_hits[tree_home(idx, ht) != numa_here]++;
+
     // Get a read-only lock to the b-tree we are working in
     *lock = &idx->locks[hv%HASHTBLSIZE];
     pthread_rwlock_rdlock(*lock);
@@ -104,15 +374,14 @@ int index_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock)
 
     // Walk down the b tree starting at the hashtbl location
     while(1) {
-	n = (BNode*)bm_ref(&idx->nodes, ip);
+	n = bnode(idx, ip);
 
 	// Look for correct slot in this node
-	for(i=0; i < FANOUT && hv >= n->hv[i]; i++) {
-	    if(hv == n->hv[i]) {
-		// exiting state found. all RO ;-)
-		*sout = (StatePtr*)bm_ref(&idx->states, ip) + i;
-		return 0;
-	    }
+	i = node_rank(n, hv);
+	if(i && hv == n->hv[i-1]) {
+	    // exiting state found. all RO ;-)
+	    *sout = bstates(idx, ip) + i-1;
+	    return 0;
 	}
 
 	if(i == FANOUT) {
@@ -125,6 +394,11 @@ int index_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock)
 	    IndexPtr tmp = hv;
 	    hv = n->hv[i];
 	    n->hv[i] = tmp;
+	    // the displaced hv takes its states along with it
+	    StatePtr *sptr = bstates(idx, ip) + i;
+	    tmp = carry;
+	    carry = *sptr;
+	    *sptr = tmp;
 	    maxip = maxip ?: ip; // remember the first max node
 	}
 
@@ -133,17 +407,16 @@ int index_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock)
 	    if(!(wr = index_upgrade_rwlock(idx, wr, ht, *lock)))
 		return -1; // failed to get rw lock. abort
 	    // This is a leaf node so put it here and were done
-	    int j = FANOUT;
-	    StatePtr *sptr = (StatePtr*)bm_ref(&idx->states, ip);
-	    while(--j > i) { // must be inserted in sorted order
-		n->hv[j] = n->hv[j-1];
-		n->ln[j] = n->ln[j-1];
-		sptr[j] = sptr[j-1];
-	    }
+	    int j = i, m = FANOUT-1 - i;
+	    StatePtr *sptr = bstates(idx, ip);
+	    // must be inserted in sorted order, the last (empty) slot drops off
+	    memmove(&n->hv[i+1], &n->hv[i], m * sizeof(HashVal));
+	    memmove(&n->ln[i+1], &n->ln[i], m * sizeof(IndexPtr));
+	    memmove(&sptr[i+1], &sptr[i], m * sizeof(StatePtr));
 	    // initilize the new node
 	    n->hv[j] = hv;
 	    n->ln[j] = 0;
-	    sptr[j] = 0;
+	    sptr[j] = carry;
 	    break;
 	} 
 	// The awnser lies somewhere under n->ln[i]
@@ -151,12 +424,12 @@ int index_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock)
 	    // need to modify idx
 	    if(!(wr = index_upgrade_rwlock(idx, wr, ht, *lock))) 		
 		return -1; // failed to get lock. abort
-	    n->ln[i] = alloc_BNode(idx);
+	    n->ln[i] = alloc_BNode(idx, ht);
 	}
 
 	ip = n->ln[i];
     }
-    *sout = (StatePtr*)bm_ref(&idx->states, maxip?:ip) + (maxip?(FANOUT-1):i);
+    *sout = bstates(idx, maxip?:ip) + (maxip?(FANOUT-1):i);
 
     // as we exit we are locked either RO or RW
     return wr;
@@ -165,11 +438,11 @@ int index_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock)
 void bnode_debug(Index *idx, Iptr ni, int depth)
 {
     int i;
-    BNode *bn = (BNode*)bm_ref(&idx->nodes, ni);
+    BNode *bn = bnode(idx, ni);
     for(i=0; i < depth; i++)
 	printf("\t");
     for(i=0; i < FANOUT; i++) {
-	printf("%2d, ",bn->hv[i]+1 ? bn->hv[i] : 0 );
+	printf(IFMT ", ",bn->hv[i]+1 ? bn->hv[i] : 0 );
 	if(bn->hv[i] != ~0 && bn->ln[i]) {
 	    printf("\n");
 	    bnode_debug(idx, bn->ln[i], depth+1);
@@ -181,20 +454,20 @@ void bnode_debug(Index *idx, Iptr ni, int depth)
 
 void index_debug(Index *idx)
 {
-    printf("Index[%d] used %d / brk %d\n", FANOUT, idx->states.used, idx->states.brk);
+    printf("Index[%d] used " IFMT " / brk " IFMT "\n", FANOUT, bm_used(&idx->states[0]), idx->states[0].brk);
     bnode_debug(idx, 1, 0);
 }
 
 int traverse(Index *idx, Iptr ni, int prev)
 {
     int i;
-    BNode *bn = (BNode*)bm_ref(&idx->nodes, ni);
+    BNode *bn = bnode(idx, ni);
     for(i=0; i < FANOUT && bn->hv[i] != ~0; i++) {
 	if(bn->ln[i])
 	    prev = traverse(idx, bn->ln[i], i?bn->hv[i-1]:prev);
 	
-	StatePtr *ptr = (StatePtr*)bm_ref(&idx->states, ni) + i;
-	printf("%2d ", *ptr);
+	StatePtr *ptr = bstates(idx, ni) + i;
+	printf(IFMT " ", *ptr);
     }
     return bn->hv[i-1];
 }
@@ -223,4 +496,137 @@ int  index_test()
   */  return 0;
 }
 
+typedef struct {
+    pthread_t thread;
+    Index *idx;
+    Iint from, to, uniq; // ops [from,to) over uniq distinct keys
+    Iint ins, oops;      // keys we inserted, aborted lookups
+} BenchArg;
+
+/** Insert keys the same way state_insert does
+ */
+static void *bench_thread(BenchArg *a)
+{
+    Iint j;
+    int wr;
+    StatePtr *sp;
+    pthread_rwlock_t *lock;
+    for(j=a->from; j < a->to; j++) {
+	HashVal hv = (HashVal)((j % a->uniq + 1) * 2654435761u);
+	if(hv == 0 || hv == ~0)
+	    hv = 1;
+	if((wr = index_ref(a->idx, hv, &sp, &lock)) < 0) {
+	    a->oops++, j--;
+	    continue;
+	}
+	if(!*sp) {
+	    if(!index_upgrade_rwlock(a->idx, wr, hv%HASHTBLSIZE, lock)) {
+		a->oops++, j--;
+		continue;
+	    }
+	    if(__sync_bool_compare_and_swap(sp, 0, j % a->uniq + 1))
+		a->ins++;
+	}
+	index_unlock(lock);
+    }
+    return NULL;
+}
+
+/** Time \a n index operations over n/2 distinct keys split across \a nthreads.
+ * Every key is looked up twice, usually by different threads.
+ */
+void index_bench(int type, int nthreads, Iint n)
+{
+    int i;
+    Index idx;
+    Iint ins = 0, oops = 0;
+    struct timespec t1, t2;
+    BenchArg *args = safe_malloc(sizeof(BenchArg) * nthreads);
+
+    index_init(&idx, FANOUT*((2*n + FANOUT-1)/FANOUT), type, -1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for(i=0; i < nthreads; i++) {
+	args[i].idx = &idx;
+	args[i].from = (unsigned long long)n * i / nthreads;
+	args[i].to = (unsigned long long)n * (i+1) / nthreads;
+	args[i].uniq = n/2;
+	args[i].ins = args[i].oops = 0;
+	pthread_create(&args[i].thread, NULL, (ThreadMain)bench_thread, &args[i]);
+    }
+    for(i=0; i < nthreads; i++) {
+	pthread_join(args[i].thread, NULL);
+	ins += args[i].ins;
+	oops += args[i].oops;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    double secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+
+    printf("%-5s %3d threads: %7.2f Mops/s  " IFMT " retries%s\n",
+	    type == INDEX_HASH ? "hash" : "btree", nthreads, n / secs / 1e6, oops,
+	    ins == n/2 ? "" : "  (LOST INSERTS)");
+    index_fini(&idx);
+    free(args);
+}
+
+#define NODE_BENCH_NODES 4096  // 256Kb of nodes at FANOUT 8, stays in L2
+
+/** Time node_rank against node_rank_scalar on \a n lookups into random nodes
+ * (a random number of keys, the rest empty).  Half the lookups hit a key.
+ */
+void index_node_bench(Iint n)
+{
+    int i, j, k, pass;
+    Iint q;
+    u64 x = 88172645463325252ULL, sum[2] = {0, 0};
+    struct timespec t1, t2;
+    double secs[2];
+    BNode *nodes;
+    HashVal *keys = safe_malloc(sizeof(HashVal) * n);
+    u32 *which = safe_malloc(sizeof(u32) * n);
 
+    if(posix_memalign((void**)&nodes, CACHE_LINE, sizeof(BNode) * NODE_BENCH_NODES))
+	DIE("Out of memory");
+#define XRAND() (x ^= x << 13, x ^= x >> 7, x ^= x << 17)
+    for(i=0; i < NODE_BENCH_NODES; i++) {
+	k = 1 + XRAND() % FANOUT;
+	for(j=0; j < FANOUT; j++) {
+	    nodes[i].hv[j] = j < k ? (HashVal)(XRAND() % ((HashVal)~0 - 1)) + 1 : (HashVal)~0;
+	    nodes[i].ln[j] = 0;
+	}
+	// insertion sort the keys
+	for(j=1; j < k; j++) {
+	    HashVal v = nodes[i].hv[j];
+	    int m = j;
+	    for(; m > 0 && nodes[i].hv[m-1] > v; m--)
+		nodes[i].hv[m] = nodes[i].hv[m-1];
+	    nodes[i].hv[m] = v;
+	}
+    }
+    for(q=0; q < n; q++) {
+	BNode *b;
+	which[q] = XRAND() % NODE_BENCH_NODES;
+	b = &nodes[which[q]];
+	keys[q] = (q & 1) ? (HashVal)(XRAND() % ((HashVal)~0 - 1)) + 1 : b->hv[XRAND() % FANOUT];
+	if(keys[q] == (HashVal)~0)
+	    keys[q] = b->hv[0];
+    }
+#undef XRAND
+
+    for(pass=0; pass < 2; pass++) {
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for(q=0; q < n; q++) {
+	    BNode *b = &nodes[which[q]];
+	    int r = pass ? node_rank(b, keys[q]) : node_rank_scalar(b, keys[q]);
+	    sum[pass] += r + (r && b->hv[r-1] == keys[q] ? FANOUT+1 : 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	secs[pass] = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+    }
+
+    printf("node search FANOUT %d, %d byte nodes: scalar %7.2f Mops/s  %s %7.2f Mops/s%s\n",
+	    FANOUT, (int)sizeof(BNode), n / secs[0] / 1e6, NODE_SIMD, n / secs[1] / 1e6,
+	    sum[0] == sum[1] ? "" : "  (MISMATCH)");
+    free(nodes);
+    free(keys);
+    free(which);
+}
@@ -1,6 +1,14 @@
+
 /**
  * A Btree sorted by the hash value
  * The hash values inserted are aprox random so no balancing is needed
+ *
+ * INDEX_HASH replaces the btrees with one open-addressing table.
+ * Slots are claimed with CAS and lookups take no locks at all.
+ *
+ * With NUMA homes the btrees are dealt out to them (hv%HASHTBLSIZE%nhome)
+ * and every home has its own node pools, so an IndexPtr is
+ * (local-1)*nhome + home + 1.
  */
 #ifndef INDEX_H
 #define INDEX_H
@@ -8,28 +16,63 @@
 #include <pthread.h>
 #include "types.h"
 #include "mem.h"
+#include "numa.h"
+
+#define INDEX_BTREE 0
+#define INDEX_HASH  1
 
 typedef struct s_BNode BNode;
+typedef struct s_ISlot ISlot;
 
 struct s_BNode {
-    HashVal  hv[FANOUT]; // hash values
+    HashVal  hv[FANOUT]; // hash values (sorted, ~0 is empty)
     IndexPtr ln[FANOUT];    // child links
-}; // Target size is one cacheline
+} __attribute__((aligned(CACHE_LINE))); // one cacheline at FANOUT 8
+
+struct s_ISlot {
+    HashVal hv;   // 0 is an empty slot
+    StatePtr sp;  // head of the chain of states that hash to hv
+};
 
 struct s_Index {
+    int type;        // INDEX_BTREE or INDEX_HASH
     pthread_rwlock_t locks[HASHTBLSIZE];  // one lock for every btree
     u32 version[HASHTBLSIZE];  // Each btree has a version that increments when it changes
-    BlockMem nodes;  // type:BNode   NOTE: Cache-Align this
-    BlockMem states; // type:StatePtr[FANOUT]
+    int nhome;       // NUMA homes the btrees are spread over
+    int home;        // the home if there is just one (-1 for none)
+    BlockMem nodes[NUMA_MAX];  // type:BNode (BlockMems are 2Mb aligned)
+    BlockMem states[NUMA_MAX]; // type:StatePtr[FANOUT]
+
+    // INDEX_HASH only
+    int bits;        // nslots == 1<<bits
+    Iint nslots;     // size of the table
+    Iint used;       // number of claimed slots
+    ISlot *slots;    // linear probing table
 };
 
-void index_init(Index *idx, Iint size);
+/** One lookup of a batch.  index_step takes it down a node (or slot) at a
+ * time, prefetching the next, so a batch of them overlaps its cache misses.
+ * Probes read without locks: they only warm the path for index_ref.
+ */
+typedef struct {
+    HashVal hv;
+    Iint at;      // btree node or hash slot to look at next (0 when done)
+    StatePtr *sp; // hv's StatePtr once found (NULL if hv isn't in yet)
+} IndexProbe;
+
+void index_init(Index *idx, Iint size, int type, int home);
 void index_fini(Index *idx);
+void index_clear(Index *idx);
 int index_ref(Index *idx, HashVal hv, StatePtr **sout, pthread_rwlock_t **lock);
 int index_upgrade_rwlock(Index *idx, int wr, int hashidx, pthread_rwlock_t *lock);
-float index_mem();
+void index_unlock(pthread_rwlock_t *lock);
+void index_probe(Index *idx, IndexProbe *p, HashVal hv);
+int index_step(Index *idx, IndexProbe *p);
+Iint index_used(Index *idx);
+float index_mem(int type);
 int index_test();
+void index_bench(int type, int nthreads, Iint n);
+void index_node_bench(Iint n);
 
 
 #endif
-
@@ -1,13 +1,29 @@
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "solver.h"
 #include "queue.h"
 #include "board.h"
 #include "list.h"
+#include "codec.h"
 
 #define Mb (1024*1024L)
 #define Gb (1024*Mb)
 
+#define USAGE "Usage: klot [options] <puzzle> <Mstates> <threads>\n" \
+    "\t-e astar|hda|direct|bfs|frontier|disk  search engine (default astar, the others find shortest)\n" \
+    "\t-t dir          where -e disk keeps its layers (default $TMPDIR or /tmp)\n" \
+    "\t-s              don't fold mirror images of states together (astar, hda, bfs)\n" \
+    "\t-i btree|hash   state index (default btree)\n" \
+    "\t-q heap|multi|bucket  priority queue (default heap, multi is astar only)\n" \
+    "\t-n nodes        split the search over this many processes (hda)\n" \
+    "\t-m Mb           memory budget for states and index (per process)\n" \
+    "\t-p thp|huge     back them with transparent or hugetlbfs 2Mb pages\n" \
+    "\t-a homes        pin threads and place memory over this many NUMA nodes (0 for all)\n" \
+    "\t-b index|queue|node  run a benchmark with <Mstates> <threads> instead\n" \
+    "\t-b codec        check the state codec round trips on <puzzle> instead"
+
 void run_tests(void)
 {
     clock_t t1,t2;
@@ -21,6 +37,57 @@ void run_tests(void)
     index_test();
 }
 
+/** Benchmarks scale from 1 thread up to \a nthreads
+ */
+void run_bench(char *name, Iint n, int nthreads)
+{
+    int t = 1;
+    if(!strcmp(name, "node")) { // single threaded
+	index_node_bench(n);
+	return;
+    }
+    while(1) {
+	if(!strcmp(name, "index")) {
+	    index_bench(INDEX_BTREE, t, n);
+	    index_bench(INDEX_HASH, t, n);
+	} else if(!strcmp(name, "queue")) {
+	    queue_bench(QUEUE_HEAP, t, n);
+	    queue_bench(QUEUE_MULTI, t, n);
+	    queue_bench(QUEUE_BUCKET, t, n);
+	} else {
+	    DIE("Unknown benchmark \'%s\'", name);
+	}
+	if(t >= nthreads)
+	    break;
+	t = (t*2 < nthreads) ? t*2 : nthreads;
+    }
+}
+
+void load_board(Board *bd, char *name)
+{
+    char filename[256];
+    FILE *file;
+    snprintf(filename, 256, "boards/%s.k", name);
+    if(!(file = fopen(filename, "r")))
+	DIE("Can't open file \'%s\'\n", filename);
+    board_init(bd, file);
+}
+
+/** Pack, unpack, rank and unrank the start of \a name and every state one
+ * move from it.  Returns nonzero if any of them didn't come back
+ */
+int run_codec_test(char *name)
+{
+    Board bd;
+    int e;
+    load_board(&bd, name);
+    e = codec_test(&bd);
+    printf("codec %s: pack %s, rank %s\n", name, (e & 1) ? "FAILED" : "ok",
+	    (e & 2) ? "FAILED" : "ok");
+    board_fini(&bd);
+    return e;
+}
+
 void write_json(Solver *ks, List *seq, FILE *stream)
 {
     int r,c;
@@ -51,44 +118,122 @@ int main(int argc, char *argv[])
 {
     Solver ks;
     Board bd;
-    char filename[256];
+    SolverOpts opts = {ENGINE_ASTAR, INDEX_BTREE, 1, 1};
+    char *bench = NULL;
     long nstates, nthreads;
-    FILE *file;
+    int opt, pages = BM_PAGES;
+    unsigned long budget = 0;
 
     set_log_level(LOG_LEVEL);
     //LOG_INFO("TESTING:\n");
     //run_tests();
 
+    while((opt = getopt(argc, argv, "e:i:q:n:b:m:p:a:t:s")) != -1) {
+	switch(opt) {
+	    case 'e':
+		if(!strcmp(optarg, "astar"))
+		    opts.engine = ENGINE_ASTAR;
+		else if(!strcmp(optarg, "hda"))
+		    opts.engine = ENGINE_HDA;
+		else if(!strcmp(optarg, "direct"))
+		    opts.engine = ENGINE_DIRECT;
+		else if(!strcmp(optarg, "bfs"))
+		    opts.engine = ENGINE_BFS;
+		else if(!strcmp(optarg, "frontier"))
+		    opts.engine = ENGINE_FRONTIER;
+		else if(!strcmp(optarg, "disk"))
+		    opts.engine = ENGINE_DISK;
+		else
+		    DIE("Unknown engine \'%s\'\n" USAGE, optarg);
+		break;
+	    case 'i':
+		if(!strcmp(optarg, "btree"))
+		    opts.index = INDEX_BTREE;
+		else if(!strcmp(optarg, "hash"))
+		    opts.index = INDEX_HASH;
+		else
+		    DIE("Unknown index \'%s\'\n" USAGE, optarg);
+		break;
+	    case 'q':
+		if(!strcmp(optarg, "heap"))
+		    opts.queue = QUEUE_HEAP;
+		else if(!strcmp(optarg, "multi"))
+		    opts.queue = QUEUE_MULTI;
+		else if(!strcmp(optarg, "bucket"))
+		    opts.queue = QUEUE_BUCKET;
+		else
+		    DIE("Unknown queue \'%s\'\n" USAGE, optarg);
+		break;
+	    case 'n': opts.nnodes = strtol(optarg, 0, 10); break;
+	    case 'b': bench = optarg; break;
+	    case 'm': budget = strtol(optarg, 0, 10) * Mb; break;
+	    case 'a': numa_init(strtol(optarg, 0, 10)); break;
+	    case 't': opts.dir = optarg; break;
+	    case 's': opts.nosym = 1; break;
+	    case 'p':
+		if(!strcmp(optarg, "thp"))
+		    pages = BM_THP;
+		else if(!strcmp(optarg, "huge"))
+		    pages = BM_HUGE;
+		else
+		    DIE("Unknown page size \'%s\'\n" USAGE, optarg);
+		break;
+	    default: DIE(USAGE);
+	}
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+    bm_config(budget, pages);
+
+    if(bench && !strcmp(bench, "codec")) {
+	if(argc < 2)
+	    DIE(USAGE);
+	return run_codec_test(argv[1]) != 0;
+    }
+    if(bench) {
+	if(argc < 3)
+	    DIE(USAGE);
+	run_bench(bench, strtol(argv[1], 0, 10) * 1024*1024, strtol(argv[2], 0, 10));
+	return 0;
+    }
+
     if(argc < 4)
-	DIE("Usage:\n\t- the name of a puzzle\n\t- the number of states\n\t- the number of threads");
+	DIE(USAGE);
 
     nstates = strtol(argv[2], 0, 10) * 1024*1024;
+    if((Iint)nstates != nstates || (Iint)(nstates * 2) != nstates * 2)
+	DIE("%ld states needs a wide=1 build", nstates);
     nthreads = strtol(argv[3], 0, 10);
-    snprintf(filename, 256, "boards/%s.k", argv[1]);
-    if(!(file = fopen(filename, "r")))
-	DIE("Can't open file \'%s\'\n", filename);
-    board_init(&bd, file);
-    printf("%d pieces %d types %d spaces\n", bd.npcs, bd.types.length, bd.nsp); 
+    opts.nthreads = nthreads;
+    opts.nstates = nstates;
+    load_board(&bd, argv[1]);
+    printf("%d pieces %d types %d spaces%s\n", bd.npcs, bd.types.length, bd.nsp,
+	    bd.sym ? " (left-right symmetric)" : ""); 
    
     // Calculate  nstates = mem / (index_mem + state_mem + ...)
-    solver_init(&ks, bd, nstates);
+    solver_init(&ks, bd, &opts);
     
     write_json(&ks, NULL, stdout);
     printf("\n\n");
 
     
-    solver_solve(&ks, nthreads);
+    solver_solve(&ks);
+    printf("Committed %lu Mb\n", bm_committed() / Mb);
     
     if(ks.solution) {
 	// solution found 
 	List seq;
 	list_init(&seq, sizeof(Move), 10);
-	solver_make_sequence(&ks, ks.solution, &seq);
+	solver_make_sequence(&ks, ks.solnode, ks.solution, &seq);
+	if(ks.engine != ENGINE_ASTAR && ks.engine != ENGINE_HDA)
+	    printf("Shortest solution: %d moves\n", seq.length);
+	else
+	    printf("Solution: %d moves (not proven shortest)\n", seq.length);
 	write_json(&ks, &seq, stdout);
 	list_fini(&seq);
     } else {
 	// no solution found
-	printf("No solution found in %d states\n", ks.states.full.used);
+	printf("No solution found in " IFMT " states\n", solver_used(&ks));
     }
     printf("\n");
     solver_fini(&ks);
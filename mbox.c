@@ -0,0 +1,102 @@
+/**
+ * Threading notes
+ *   1) init/fini are not thread-safe
+ *   2) post is safe from any thread, take only from the owner
+ *
+ * The owner always takes the whole stack at once so there is no ABA problem.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "base.h"
+#include "mbox.h"
+
+/** Allocate an empty batch with room for \a nrec records of \a rsize bytes
+ */
+MBatch *mbox_batch(int nrec, int rsize)
+{
+    MBatch *b = safe_malloc(sizeof(MBatch) + nrec * rsize);
+    b->next = NULL;
+    b->n = 0;
+    return b;
+}
+
+void mbox_init(Mbox *mb)
+{
+    memset(mb, 0, sizeof(Mbox));
+}
+
+/** Frees any batches that were never taken
+ */
+void mbox_fini(Mbox *mb)
+{
+    MBatch *b = mbox_take(mb), *next;
+    for(; b; b = next) {
+	next = b->next;
+	free(b);
+    }
+}
+
+/** Push \a b onto the mailbox.  The batch now belongs to the owner.
+ */
+void mbox_post(Mbox *mb, MBatch *b)
+{
+    MBatch *head;
+    do {
+	head = __atomic_load_n(&mb->head, __ATOMIC_RELAXED);
+	b->next = head;
+    } while(!__sync_bool_compare_and_swap(&mb->head, head, b));
+    mbox_wake(mb);
+}
+
+/** Take every posted batch.  They are returned oldest first.
+ */
+MBatch *mbox_take(Mbox *mb)
+{
+    MBatch *b, *next, *prev = NULL;
+    if(!__atomic_load_n(&mb->head, __ATOMIC_RELAXED))
+	return NULL;
+    b = __atomic_exchange_n(&mb->head, NULL, __ATOMIC_ACQUIRE);
+    // reverse the stack
+    for(; b; b = next) {
+	next = b->next;
+	b->next = prev;
+	prev = b;
+    }
+    return prev;
+}
+
+int mbox_empty(Mbox *mb)
+{
+    return !__atomic_load_n(&mb->head, __ATOMIC_RELAXED);
+}
+
+/** Where the mailbox is at.  Read it before looking for batches and hand
+ * it to mbox_wait
+ */
+int mbox_seq(Mbox *mb)
+{
+    return __atomic_load_n(&mb->seq, __ATOMIC_ACQUIRE);
+}
+
+/** Owner only.  Sleep unless something was posted (or mbox_wake was called)
+ * since mbox_seq returned \a seq
+ */
+void mbox_wait(Mbox *mb, int seq)
+{
+    mb->sleeping = 1;
+    __sync_synchronize(); // a post either sees us sleeping or changes seq first
+    if(mb->seq == seq)
+	syscall(SYS_futex, &mb->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+    mb->sleeping = 0;
+}
+
+/** Get the owner out of mbox_wait (to look at the mailbox or anything else)
+ */
+void mbox_wake(Mbox *mb)
+{
+    __sync_fetch_and_add(&mb->seq, 1);
+    if(mb->sleeping)
+	syscall(SYS_futex, &mb->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
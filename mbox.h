@@ -0,0 +1,40 @@
+/** \file mbox.h
+ * Lock-free mailboxes for handing batches of states between threads.
+ * Any number of threads may post to a mailbox but only its owner takes.
+ * An owner with nothing to do can sleep until the next post (mbox_wait).
+ */
+#ifndef MBOX_H
+#define MBOX_H
+
+#include "types.h"
+
+#define MBOX_BATCH 64   // records per batch
+#define MBOX_FLUSH 32   // expansions between flushing partial batches
+
+typedef struct s_MBatch MBatch;
+typedef struct s_Mbox Mbox;
+
+struct s_MBatch {
+    MBatch *next;  // next batch in the mailbox
+    int n;         // number of records used
+    char data[];   // records (the size is up to the user)
+};
+
+struct s_Mbox {
+    MBatch *head;  // stack of posted batches
+    volatile int seq; // futex. bumped by every post (and mbox_wake)
+    int sleeping;  // the owner is in mbox_wait
+    char pad[CACHE_LINE - sizeof(MBatch*) - 2*sizeof(int)];  // one mailbox per cacheline
+};
+
+MBatch *mbox_batch(int nrec, int rsize);
+void mbox_init(Mbox *mb);
+void mbox_fini(Mbox *mb);
+void mbox_post(Mbox *mb, MBatch *b);
+MBatch *mbox_take(Mbox *mb);
+int mbox_empty(Mbox *mb);
+int mbox_seq(Mbox *mb);
+void mbox_wait(Mbox *mb, int seq);
+void mbox_wake(Mbox *mb);
+
+#endif
@@ -1,56 +1,228 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "base.h"
 #include "mem.h"
+#include "numa.h"
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+static unsigned long budget;    // most bytes all BlockMems may commit (0 for no limit)
+static unsigned long committed; // bytes they have committed
+static int page_mode = BM_PAGES;
+static u32 next_id;             // for BlockMem.id
+
+/** Each thread's chunks, found by BlockMem
+ */
+static __thread struct {
+    BlockMem *bm;
+    u32 id;
+    BMCursor *c;
+} tcache[BM_TCACHE];
+static __thread int tcache_next;
+
+/** Set the memory budget and page size for BlockMems made after this
+ */
+void bm_config(unsigned long bytes, int pages)
+{
+    budget = bytes;
+    page_mode = pages;
+}
+
+unsigned long bm_committed(void)
+{
+    return committed;
+}
+
+unsigned long bm_budget(void)
+{
+    return budget;
+}
 
 void bm_init(BlockMem *bm, Iptr bsize, Iptr num)
 {
-    // allocate with stdlib or kernel memmap?
     unsigned long totsize = (unsigned long)bsize*num;
+    void *mem;
     memset(bm, 0, sizeof(BlockMem));
-    bm->mem = malloc(totsize);
-    if(!bm->mem)
-	DIE("No mem");
-    /*printf("Zeroing %dx%d: %p - %p\n", bsize, num,
-	bm->mem, bm->mem+totsize-1);
-    unsigned long i;
-    for(i=0; i < totsize; i++)
-	((u8*)bm->mem)[i] = 0;
-    */
     bm->num = num;
     bm->bsize = bsize;
+    bm->pages = page_mode;
+    bm->id = __sync_add_and_fetch(&next_id, 1);
+    bm->home = -1;
     pthread_mutex_init(&bm->lock, NULL);
+    // whole huge pages so the ends can be huge too
+    bm->reserved = (totsize + BM_HUGE_SIZE-1) & ~(BM_HUGE_SIZE-1);
+
+    // Reserve address space only, with room to line it up on a huge page.
+    // PROT_NONE isn't charged to us until bm_commit maps over it.
+    mem = mmap(NULL, bm->reserved + BM_HUGE_SIZE, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED)
+	DIE("Can't reserve %lu Mb", bm->reserved >> 20);
+    bm->mem = (void*)(((unsigned long)mem + BM_HUGE_SIZE-1) & ~(BM_HUGE_SIZE-1));
+    if(bm->mem != mem)
+	munmap(mem, bm->mem - mem);
+    munmap(bm->mem + bm->reserved, mem + BM_HUGE_SIZE - bm->mem);
 }
 
 void bm_fini(BlockMem *bm)
 {
-    free(bm->mem);
+    munmap(bm->mem, bm->reserved);
+    free(bm->cur);
+    bm->cur = NULL;
+    __sync_fetch_and_sub(&committed, bm->committed);
     bm->mem = 0;
     pthread_mutex_destroy(&bm->lock);
 }
 
+/** Forget every slot and give back the memory behind them.  The reservation
+ * stays so \a bm can fill up again.  Nobody may be using it
+ */
+void bm_clear(BlockMem *bm)
+{
+    if(bm->committed && mmap(bm->mem, bm->committed, PROT_NONE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0) == MAP_FAILED)
+	DIE("Can't release %lu Mb", bm->committed >> 20);
+    __sync_fetch_and_sub(&committed, bm->committed);
+    bm->committed = 0;
+    bm->ncommit = bm->brk = bm->used = bm->free = 0;
+    bm->id = __sync_add_and_fetch(&next_id, 1); // the threads let go of their chunks
+    if(bm->cur)
+	bm_chunk(bm, bm->chunk);
+}
+
+/** Commit the next piece of the reservation, growing by half what we have
+ * up to BM_STEP (or what the budget has left).
+ * Called with bm->lock held.  Returns 0 when there is no more to be had
+ */
+static int bm_commit(BlockMem *bm)
+{
+    unsigned long step = (bm->committed/2 + BM_HUGE_SIZE-1) & ~(BM_HUGE_SIZE-1), have, was;
+    void *at = bm->mem + bm->committed;
+    if(step < BM_HUGE_SIZE)
+	step = BM_HUGE_SIZE;
+    if(step > BM_STEP)
+	step = BM_STEP;
+    if(step > bm->reserved - bm->committed)
+	step = bm->reserved - bm->committed;
+    if(!step)
+	return 0;
+    if(!budget) {
+	__sync_fetch_and_add(&committed, step);
+    } else {
+	// take our step out of the budget before anyone else can
+	do {
+	    was = __atomic_load_n(&committed, __ATOMIC_RELAXED);
+	    have = (was < budget) ? (budget - was) & ~(BM_HUGE_SIZE-1) : 0;
+	    if(!have)
+		return 0;
+	} while(!__sync_bool_compare_and_swap(&committed, was, was + (step < have ? step : have)));
+	if(step > have)
+	    step = have;
+    }
+
+    // Map over the reservation.  hugetlbfs pages are taken from the pool
+    // now, not when touched.  (a failed MAP_FIXED may have unmapped it)
+    if(bm->pages == BM_HUGE && mmap(at, step, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_HUGETLB, -1, 0) == MAP_FAILED) {
+	printf("Out of huge pages, using THP\n");
+	bm->pages = BM_THP;
+    }
+    if(bm->pages != BM_HUGE) {
+	if(mmap(at, step, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED) {
+	    __sync_fetch_and_sub(&committed, step); // the kernel said no
+	    return 0;
+	}
+	if(bm->pages == BM_THP)
+	    madvise(at, step, MADV_HUGEPAGE);
+    }
+    numa_bind(at, step, bm->home);
+    bm->committed += step;
+    bm->ncommit = bm->committed / bm->bsize;
+    if(bm->ncommit > bm->num)
+	bm->ncommit = bm->num;
+    return bm->brk < bm->ncommit; // a big block may need another step
+}
+
+/** Give every thread its own chunks of \a n slots
+ */
+void bm_chunk(BlockMem *bm, Iint n)
+{
+    bm->chunk = n;
+    bm->ncur = 0;
+    if(!bm->cur && posix_memalign((void**)&bm->cur, CACHE_LINE, sizeof(BMCursor) * BM_MAXTHREADS))
+	DIE("No mem");
+    memset(bm->cur, 0, sizeof(BMCursor) * BM_MAXTHREADS);
+}
+
+/** This thread's cursor in \a bm (or NULL if there are too many threads)
+ */
+static inline BMCursor *bm_cursor(BlockMem *bm)
+{
+    int i, c;
+    for(i=0; i < BM_TCACHE; i++)
+	if(tcache[i].bm == bm && tcache[i].id == bm->id)
+	    return tcache[i].c;
+    // first time here
+    i = tcache_next++ % BM_TCACHE;
+    c = __sync_fetch_and_add(&bm->ncur, 1);
+    tcache[i].bm = bm;
+    tcache[i].id = bm->id;
+    tcache[i].c = (c < BM_MAXTHREADS) ? &bm->cur[c] : NULL;
+    return tcache[i].c;
+}
+
+/** Number of slots in use.  (Only a snapshot while threads are allocating)
+ */
+Iint bm_used(BlockMem *bm)
+{
+    int i;
+    Iint used = bm->used;
+    for(i=0; bm->cur && i < bm->ncur && i < BM_MAXTHREADS; i++)
+	used += bm->cur[i].n;
+    return used;
+}
+
 inline void *bm_ref(BlockMem *bm, Iptr el)
 {
     ASSERT(el, "Null Iptr deref");
-    ASSERT(el <= bm->num, "Iptr out of range %u", el);
+    ASSERT(el <= bm->num, "Iptr out of range " IFMT, el);
     unsigned long off = (unsigned long)(el-1) * bm->bsize;
     return (void*)bm->mem + off;
 }
 
 Iptr bm_alloc(BlockMem *bm)
 {
+    BMCursor *c = bm->chunk ? bm_cursor(bm) : NULL;
+    Iint n;
+    if(c && c->next < c->end) { // the fast path
+	c->n++;
+	return ++c->next;
+    }
+
     pthread_mutex_lock(&bm->lock);
     Iptr blk = 0;
-    bm->used ++;
     if(bm->free) { // we have a chain of free blks
 	blk = bm->free;
 	bm->free = *(Iptr*)bm_ref(bm, bm->free);
-    } else if(bm->brk < bm->num) {
-	bm->brk++;
-	blk = bm->brk;
-    } else {
-	bm->used --;
+	bm->used ++;
+    } else if(bm->brk < bm->ncommit || (bm->brk < bm->num && bm_commit(bm))) {
+	if(c) { // carve a new chunk
+	    n = bm->ncommit - bm->brk;
+	    c->next = bm->brk;
+	    c->end = bm->brk + (n < bm->chunk ? n : bm->chunk);
+	    bm->brk = c->end;
+	    c->n++;
+	    blk = ++c->next;
+	} else {
+	    bm->brk++;
+	    blk = bm->brk;
+	    bm->used ++;
+	}
     }
     pthread_mutex_unlock(&bm->lock);
     return blk;
@@ -59,8 +231,11 @@ Iptr bm_alloc(BlockMem *bm)
 void bm_free(BlockMem *bm, Iptr el)
 {
     Iptr *i = (Iptr*)bm_ref(bm, el);
+    pthread_mutex_lock(&bm->lock);
     *i = bm->free;
     bm->free = el;
+    bm->used --;
+    pthread_mutex_unlock(&bm->lock);
 }
 
 
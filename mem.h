@@ -1,22 +1,65 @@
-
+/** \file mem.h
+ * Fixed size blocks addressed by a 1-based Iptr.
+ *
+ * A BlockMem reserves address space for all \a num blocks up front but
+ * only commits it BM_STEP bytes at a time as the blocks get used, so a
+ * generous \a num costs nothing.  What every BlockMem commits together is
+ * held to the budget given to bm_config.
+ *
+ * After bm_chunk, every thread takes runs of consecutive slots and allocates
+ * from them without the lock.
+ */
 #ifndef MEM_H
 #define MEM_H
 
 #include <pthread.h>
 #include "types.h"
 
+#define BM_STEP (32*1024*1024L)  // bytes committed at a time (a multiple of 2Mb)
+#define BM_HUGE_SIZE (2*1024*1024L)
+
+#define BM_CHUNK 64      // slots a thread takes at a time (see bm_chunk)
+#define BM_MAXTHREADS 64 // threads that get their own chunks (the rest lock)
+#define BM_TCACHE 8      // BlockMems a thread remembers its chunk of
+
+#define BM_PAGES 0  // normal pages
+#define BM_THP   1  // ask for transparent huge pages
+#define BM_HUGE  2  // explicit huge pages (hugetlbfs pool), else THP
+
+/** A thread's run of slots (next, end]
+ */
+typedef struct {
+    Iptr next, end;
+    Iint n;      // slots handed out from chunks
+} __attribute__((aligned(CACHE_LINE))) BMCursor;
+
 struct s_BlockMem {
     Iint bsize;  // size of block;
     Iint num;   // number of possible slots
     Iint used;  // number of used slots
     Iint brk;   // first of virgin slots
     Iptr free;  // first of free chain
+    Iint ncommit; // slots that are backed by committed memory
+    unsigned long reserved; // bytes of address space at mem
+    unsigned long committed; // bytes of it committed
+    int pages;  // BM_PAGES, BM_THP or BM_HUGE
+    Iint chunk; // slots per thread chunk (0 if everyone locks)
+    BMCursor *cur; // per thread chunks
+    int ncur;   // cursors claimed
+    u32 id;     // tells the thread caches this BlockMem from an old one
+    int home;   // NUMA home to commit memory on (-1 for first touch)
     pthread_mutex_t lock;
     void *mem;
 };
 
+void bm_config(unsigned long budget, int pages);
+unsigned long bm_committed(void);
+unsigned long bm_budget(void);
 void bm_init(BlockMem *bm, Iint bsize, Iint max);
 void bm_fini(BlockMem *bm);
+void bm_clear(BlockMem *bm);
+void bm_chunk(BlockMem *bm, Iint n);
+Iint bm_used(BlockMem *bm);
 void *bm_ref(BlockMem *bm, Iptr el);
 Iptr bm_alloc(BlockMem *bm);
 void bm_free(BlockMem *bm, Iptr el);
@@ -24,4 +67,3 @@ void bm_free(BlockMem *bm, Iptr el);
 
 #endif
 
-
@@ -0,0 +1,211 @@
+/**
+ * Threading notes
+ *   1) a Net belongs to one thread of each node process
+ *   2) the shared block is only touched with atomics
+ */
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "base.h"
+#include "net.h"
+
+/** Make room for \a n more bytes after b->len
+ */
+static void buf_reserve(NetBuf *b, unsigned long n)
+{
+    if(b->len + n > b->size) {
+	// slide down what is left before growing
+	memmove(b->buf, b->buf + b->off, b->len - b->off);
+	b->len -= b->off;
+	b->off = 0;
+	while(b->len + n > b->size)
+	    b->size = b->size ? b->size*2 : 1<<16;
+	if(!(b->buf = realloc(b->buf, b->size)))
+	    DIE("No mem");
+    }
+}
+
+static void buf_append(NetBuf *b, void *data, unsigned long n)
+{
+    buf_reserve(b, n);
+    memcpy(b->buf + b->len, data, n);
+    b->len += n;
+}
+
+/** Fork nnodes-1 more processes.  Every process returns with net->node set.
+ * The block of shsize bytes every node shares starts as a copy of \a shared
+ * and is returned.
+ */
+void *net_init(Net *net, int nnodes, int rsize, void *shared, int shsize)
+{
+    int i, j, (*fds)[2];
+    memset(net, 0, sizeof(Net));
+    net->nnodes = nnodes;
+    net->rsize = rsize;
+    net->shsize = shsize;
+    net->shared = mmap(NULL, shsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(net->shared == MAP_FAILED)
+	DIE("Can't map shared memory");
+    memcpy(net->shared, shared, shsize);
+    net->peer = calloc(nnodes, sizeof(NetPeer));
+    net->pids = calloc(nnodes, sizeof(pid_t));
+
+    // socketpair [i*nnodes+j] joins i (end 0) and j (end 1)
+    fds = calloc(nnodes*nnodes, sizeof(int[2]));
+    for(i=0; i < nnodes; i++)
+	for(j=i+1; j < nnodes; j++)
+	    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i*nnodes+j]))
+		DIE("socketpair failed");
+
+    fflush(stdout); // or the children print it again
+    for(i=1; i < nnodes; i++) {
+	if((net->pids[i] = fork()) < 0)
+	    DIE("fork failed");
+	if(!net->pids[i]) {
+	    net->node = i;
+	    break;
+	}
+    }
+
+    // keep our ends and close everything else
+    for(i=0; i < nnodes; i++) {
+	for(j=i+1; j < nnodes; j++) {
+	    if(i == net->node) {
+		net->peer[j].fd = fds[i*nnodes+j][0];
+		close(fds[i*nnodes+j][1]);
+	    } else if(j == net->node) {
+		net->peer[i].fd = fds[i*nnodes+j][1];
+		close(fds[i*nnodes+j][0]);
+	    } else {
+		close(fds[i*nnodes+j][0]);
+		close(fds[i*nnodes+j][1]);
+	    }
+	}
+    }
+    free(fds);
+    for(i=0; i < nnodes; i++)
+	if(i != net->node)
+	    fcntl(net->peer[i].fd, F_SETFL, O_NONBLOCK);
+    return net->shared;
+}
+
+/** Node 0 tells the others to quit and waits for them
+ */
+void net_fini(Net *net)
+{
+    int i;
+    net->closing = 1;
+    if(!net->node) {
+	for(i=1; i < net->nnodes; i++)
+	    net_send(net, i, NET_QUIT, 0, NULL, 0);
+	for(i=1; i < net->nnodes; i++) {
+	    while(net->peer[i].out.off < net->peer[i].out.len)
+		net_poll(net, 100);
+	}
+	for(i=1; i < net->nnodes; i++)
+	    waitpid(net->pids[i], NULL, 0);
+    }
+    for(i=0; i < net->nnodes; i++) {
+	if(i == net->node)
+	    continue;
+	close(net->peer[i].fd);
+	free(net->peer[i].out.buf);
+	free(net->peer[i].in.buf);
+    }
+    free(net->peer);
+    free(net->pids);
+    munmap(net->shared, net->shsize);
+}
+
+/** Queue a frame of \a n records for \a node.  It goes out on the next net_poll
+ */
+void net_send(Net *net, int node, u32 type, Iptr arg, void *recs, int n)
+{
+    NetHdr h = {type, n, arg, net->node};
+    buf_append(&net->peer[node].out, &h, sizeof(NetHdr));
+    if(n)
+	buf_append(&net->peer[node].out, recs, (unsigned long)n * net->rsize);
+}
+
+/** Write what we can, read what there is.
+ * Waits up to \a timeout ms for something to happen (0 doesn't wait)
+ */
+void net_poll(Net *net, int timeout)
+{
+    int i, n = 0;
+    long r;
+    struct pollfd *pfd = alloca(sizeof(struct pollfd) * net->nnodes);
+    NetPeer *p;
+
+    for(i=0; i < net->nnodes; i++) {
+	if(i == net->node)
+	    continue;
+	pfd[n].fd = net->peer[i].fd;
+	pfd[n].events = POLLIN;
+	if(net->peer[i].out.off < net->peer[i].out.len)
+	    pfd[n].events |= POLLOUT;
+	n++;
+    }
+    if(poll(pfd, n, timeout) <= 0)
+	return;
+
+    for(i=0, n=0; i < net->nnodes; i++) {
+	if(i == net->node)
+	    continue;
+	p = &net->peer[i];
+	if(pfd[n].revents & POLLOUT) {
+	    r = send(p->fd, p->out.buf + p->out.off, p->out.len - p->out.off, MSG_NOSIGNAL);
+	    if(r > 0)
+		p->out.off += r;
+	    if(p->out.off == p->out.len)
+		p->out.off = p->out.len = 0;
+	}
+	if(pfd[n].revents & (POLLIN|POLLHUP|POLLERR)) {
+	    while(1) {
+		buf_reserve(&p->in, 1<<15);
+		r = recv(p->fd, p->in.buf + p->in.len, p->in.size - p->in.len, 0);
+		if(r > 0) {
+		    p->in.len += r;
+		} else {
+		    if(r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			if(!net->closing)
+			    DIE("Lost node %d", i);
+			p->out.off = p->out.len = 0; // nobody to send it to
+		    }
+		    break;
+		}
+	    }
+	}
+	n++;
+    }
+}
+
+/** Returns the next complete frame that came in, or NULL.
+ * It is valid until the next call to net_poll
+ */
+NetHdr *net_next(Net *net)
+{
+    int i;
+    NetHdr *h;
+    NetBuf *b;
+    for(i=0; i < net->nnodes; i++) {
+	if(i == net->node)
+	    continue;
+	b = &net->peer[i].in;
+	if(b->len - b->off < sizeof(NetHdr))
+	    continue;
+	h = (NetHdr*)(b->buf + b->off);
+	unsigned long fsize = sizeof(NetHdr) + (unsigned long)h->n * net->rsize;
+	if(b->len - b->off < fsize)
+	    continue;
+	b->off += fsize;
+	return h;
+    }
+    return NULL;
+}
@@ -0,0 +1,57 @@
+/** \file net.h
+ * Transport for running the partitions as separate processes.
+ *
+ * Node 0 is the original process and forks the others.  Every pair of nodes
+ * is joined by a unix-domain socketpair and all nodes share one small
+ * control block.  Sockets are non-blocking and frames are buffered both ways,
+ * so nobody can deadlock on a full socket while its peer is doing the same.
+ */
+#ifndef NET_H
+#define NET_H
+
+#include <sys/types.h>
+#include "types.h"
+
+#define NET_BATCH 1  // n state records
+#define NET_REF   2  // send back state arg
+#define NET_STATE 3  // the one record answering a NET_REF
+#define NET_QUIT  4  // we are done with you
+
+typedef struct s_Net Net;
+
+typedef struct {
+    u32 type;   // NET_*
+    u32 n;      // number of records that follow
+    Iptr arg;   // NET_REF: the state wanted
+    u32 from;   // node that sent it
+} NetHdr;
+
+typedef struct {
+    char *buf;
+    unsigned long off, len, size;  // [off, len) is waiting to be used
+} NetBuf;
+
+typedef struct {
+    int fd;
+    NetBuf out;  // frames waiting to be written
+    NetBuf in;   // bytes read but not yet handled
+} NetPeer;
+
+struct s_Net {
+    int nnodes;     // total number of nodes
+    int node;       // the index of our node
+    int rsize;      // size of a record
+    void *shared;   // control block shared by all nodes
+    int shsize;
+    int closing;    // peers hanging up is expected
+    NetPeer *peer;  // one per node (ours is unused)
+    pid_t *pids;    // node 0 only.  The other nodes
+};
+
+void *net_init(Net *net, int nnodes, int rsize, void *shared, int shsize);
+void net_fini(Net *net);
+void net_send(Net *net, int node, u32 type, Iptr arg, void *recs, int n);
+void net_poll(Net *net, int timeout);
+NetHdr *net_next(Net *net);
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * Threading notes
+ *   1) numa_init is not thread-safe
+ *   2) numa_pin sets up the calling thread only
+ *
+ * There is no libnuma here.  The topology comes from sysfs and memory is
+ * placed with the raw mbind syscall.  Asking for more homes than the machine
+ * has nodes wraps them around (which is handy for testing on one socket).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "base.h"
+#include "numa.h"
+
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+
+int numa_nodes = 0;
+__thread int numa_here = -1;
+__thread Iint numa_hits[2];
+
+static int nreal;              // nodes the machine has
+static int ncpus[NUMA_MAX];    // cpus on each node
+static int cpus[NUMA_MAX][CPU_SETSIZE];
+
+/** Parse a sysfs cpulist like "0-7,16-23" into node \a n
+ */
+static void read_cpulist(int n, char *s)
+{
+    int a, b, len;
+    while(sscanf(s, "%d%n", &a, &len) == 1) {
+	s += len;
+	b = a;
+	if(*s == '-' && sscanf(s+1, "%d%n", &b, &len) == 1)
+	    s += len + 1;
+	for(; a <= b && ncpus[n] < CPU_SETSIZE; a++)
+	    cpus[n][ncpus[n]++] = a;
+	if(*s != ',')
+	    break;
+	s++;
+    }
+}
+
+/** Find the nodes and their cpus.  \a want homes (0 for one per node)
+ * Returns the number of homes
+ */
+int numa_init(int want)
+{
+    char path[64], line[4096];
+    FILE *f;
+    int n;
+
+    for(nreal=0; nreal < NUMA_MAX; nreal++) {
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nreal);
+	if(!(f = fopen(path, "r")))
+	    break;
+	ncpus[nreal] = 0;
+	if(fgets(line, sizeof(line), f))
+	    read_cpulist(nreal, line);
+	fclose(f);
+    }
+    if(!nreal) { // no sysfs, call it one node
+	nreal = 1;
+	ncpus[0] = sysconf(_SC_NPROCESSORS_ONLN);
+	for(n=0; n < ncpus[0]; n++)
+	    cpus[0][n] = n;
+    }
+    numa_nodes = want ? want : nreal;
+    if(numa_nodes > NUMA_MAX)
+	numa_nodes = NUMA_MAX;
+    printf("NUMA: %d nodes, %d homes\n", nreal, numa_nodes);
+    return numa_nodes;
+}
+
+/** Home of thread (or partition) \a i of \a n.  Neighbours share a home
+ */
+int numa_home(int i, int n)
+{
+    if(numa_nodes <= 1)
+	return 0;
+    return (int)((long)i * numa_nodes / n);
+}
+
+/** Pin the calling thread, number \a i of \a n, to a cpu of its home
+ */
+void numa_pin(int i, int n)
+{
+    cpu_set_t set;
+    int home, node, first;
+    if(!numa_nodes)
+	return;
+    home = numa_home(i, n);
+    node = home % nreal;
+    first = (int)(((long)home * n + numa_nodes - 1) / numa_nodes); // first thread of this home
+    CPU_ZERO(&set);
+    if(ncpus[node])
+	CPU_SET(cpus[node][(i - first) % ncpus[node]], &set);
+    if(ncpus[node] && sched_setaffinity(0, sizeof(set), &set))
+	printf("NUMA: can't pin thread %d\n", i);
+    numa_here = home;
+    numa_hits[0] = numa_hits[1] = 0;
+}
+
+static void mbind_mode(void *addr, unsigned long len, int mode, unsigned long mask)
+{
+    // mbind wants the range page aligned
+    unsigned long a = (unsigned long)addr & ~4095UL;
+    syscall(SYS_mbind, a, len + ((unsigned long)addr - a), mode, &mask, NUMA_MAX+1, 0);
+}
+
+/** Put the (untouched) pages of [addr, addr+len) on \a home's node
+ * (if it has room)
+ */
+void numa_bind(void *addr, unsigned long len, int home)
+{
+    if(numa_nodes && home >= 0)
+	mbind_mode(addr, len, MPOL_PREFERRED, 1UL << (home % nreal));
+}
+
+/** Spread [addr, addr+len) over all the nodes
+ */
+void numa_interleave(void *addr, unsigned long len)
+{
+    if(numa_nodes > 1 && nreal > 1)
+	mbind_mode(addr, len, MPOL_INTERLEAVE, (1UL << nreal) - 1);
+}
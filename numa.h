@@ -0,0 +1,25 @@
+/** \file numa.h
+ * Thread pinning and memory placement for multi-socket machines.
+ *
+ * Threads (or HDA* partitions) are spread evenly over the NUMA nodes and a
+ * thread's home is the node it is pinned to.  Memory is bound with mbind
+ * before it is touched.  Everything is a no-op until numa_init.
+ */
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "types.h"
+
+#define NUMA_MAX 8  // homes we keep track of
+
+extern int numa_nodes;           // homes in use (0 if numa_init wasn't called)
+extern __thread int numa_here;   // home of this thread (-1 if not pinned)
+extern __thread Iint numa_hits[2]; // index lookups on [our home, another home]
+
+int numa_init(int want);
+int numa_home(int i, int n);
+void numa_pin(int i, int n);
+void numa_bind(void *addr, unsigned long len, int home);
+void numa_interleave(void *addr, unsigned long len);
+
+#endif
@@ -1,55 +1,217 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 #include "base.h"
 #include "queue.h"
 
+static void heap_init(Queue *q, Iint size)
+{
+    int i;
+    memset(q, 0, sizeof(Queue));
+    q->pqraw = malloc(sizeof(PQNode) * (size+CACHE_LINE));
+    unsigned long ptr = (unsigned long)q->pqraw;
+    q->pq = (void*)((ptr + CACHE_LINE) & ~(CACHE_LINE-1)) ;
+    q->len = size;
+    // the first set is always there so the top can be peeked at
+    for(i=0; i< QFANOUT; i++)
+	q->pq[i].pri = PRIORITY_MAX;
+    q->brk = QFANOUT;
+    q->top = PRIORITY_MAX;
+    pthread_mutex_init(&q->lock, NULL);
+}
 
 void queue_init(Queue *q, Iint size)
 {
+    if(size % QFANOUT)
+	DIE("Size must be a multiple of %lu", QFANOUT);
+    heap_init(q, size);
+    printf("Queue Size = " IFMT "\n", size);
+}
+
+/** A MultiQueue of \a nsub heaps sharing \a size entries
+ */
+void queue_init_multi(Queue *q, Iint size, int nsub)
+{
+    int i;
+    Iint subsize = QFANOUT * ((size / nsub + QFANOUT-1) / QFANOUT);
     if(size % QFANOUT)
 	DIE("Size must be a multiple of %lu", QFANOUT);
 
     memset(q, 0, sizeof(Queue));
-    q->pqraw = malloc(sizeof(PQNode) * (size+CACHE_LINE));
-    unsigned long ptr = (unsigned long)q->pqraw;
-    q->pq = (void*)((ptr + CACHE_LINE) & ~(CACHE_LINE-1)) ;
+    q->type = QUEUE_MULTI;
     q->len = size;
-    printf("Queue Size = %u\n", size);
+    q->nsub = nsub;
+    q->sub = safe_malloc(sizeof(Queue) * nsub);
+    for(i=0; i < nsub; i++)
+	heap_init(&q->sub[i], subsize);
+    printf("Queue Size = " IFMT " in %d heaps\n", size, nsub);
+}
+
+/** A bucket queue.  O(1) push and pop, FIFO among equal priorities.
+ * Buckets and chunks are added as they are needed so it never fills up.
+ */
+void queue_init_bucket(Queue *q)
+{
+    memset(q, 0, sizeof(Queue));
+    q->type = QUEUE_BUCKET;
+    q->nbkt = 256;
+    q->bkt = calloc(q->nbkt, sizeof(QBucket));
     pthread_mutex_init(&q->lock, NULL);
+    printf("Queue Size = unbounded, %d buckets per step\n", QBUCKET_SCALE);
+}
+
+static void chunks_free(QChunk *c)
+{
+    QChunk *next;
+    for(; c; c = next) {
+	next = c->next;
+	free(c);
+    }
 }
 
 void queue_fini(Queue *q)
 {
+    int i;
+    if(q->type == QUEUE_BUCKET) {
+	for(i=0; i < q->nbkt; i++)
+	    chunks_free(q->bkt[i].first);
+	chunks_free(q->free);
+	free(q->bkt);
+	pthread_mutex_destroy(&q->lock);
+	return;
+    }
+    if(q->type == QUEUE_MULTI) {
+	for(i=0; i < q->nsub; i++)
+	    queue_fini(&q->sub[i]);
+	free(q->sub);
+	return;
+    }
     free(q->pqraw);
     pthread_mutex_destroy(&q->lock);
 }
 
-void queue_push(Queue *q, StatePtr sp, float pri)
+/** Cheap per thread random numbers (xorshift)
+ */
+static __thread u32 qseed;
+
+static inline u32 qrand(void)
 {
-    int i;
-    pthread_mutex_lock(&q->lock);
+    u32 x = qseed;
+    if(!x)
+	x = (u32)(unsigned long)&qseed | 1; // differs between threads
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return qseed = x;
+}
 
+/** Push onto a single heap, the caller holds the lock.
+ * Returns 0 if it is full.
+ */
+static int heap_push(Queue *q, StatePtr sp, float pri)
+{
+    int i;
     if(q->num == q->brk) {
-        // this is virgin memory that has not been initlized
-        if(q->num == q->len)
-            DIE("Queue FULL");
-        for(i=0; i< QFANOUT; i++)
+	// this is virgin memory that has not been initlized
+	if(q->num == q->len)
+	    return 0;
+	for(i=0; i< QFANOUT; i++)
 	    q->pq[q->brk+i].pri = PRIORITY_MAX;
-        q->brk += QFANOUT;
+	q->brk += QFANOUT;
     }
 
     // Walk it up the tree
     PQNode *node = &q->pq[q->num];
     Iptr p = q->num / QFANOUT;
     while(p && pri < q->pq[--p].pri) {
-        *node = q->pq[p];
-        node = &q->pq[p];
-        p /= QFANOUT;
+	*node = q->pq[p];
+	node = &q->pq[p];
+	p /= QFANOUT;
     }
     node->pri = pri;
     node->sp = sp;
     q->num ++;
+    return 1;
+}
+
+/** Push onto a random heap that we can lock straight away
+ */
+static void multi_push(Queue *q, StatePtr sp, float pri)
+{
+    int tries, ok;
+    Queue *h;
+    for(tries=0; ; tries++) {
+	h = &q->sub[qrand() % q->nsub];
+	if(tries < q->nsub) {
+	    if(pthread_mutex_trylock(&h->lock))
+		continue;
+	} else {
+	    if(tries > 4*q->nsub)
+		DIE("Queue FULL");
+	    pthread_mutex_lock(&h->lock);
+	}
+	ok = heap_push(h, sp, pri);
+	if(pri < h->top)
+	    h->top = pri;
+	pthread_mutex_unlock(&h->lock);
+	if(ok)
+	    break;
+    }
+    __sync_fetch_and_add(&q->num, 1);
+}
+
+/** Append to the FIFO of pri's bucket, the caller holds the lock
+ */
+static void bucket_push(Queue *q, StatePtr sp, float pri)
+{
+    Iint i = pri * QBUCKET_SCALE, n;
+    QBucket *b;
+    QChunk *c;
+
+    if(i >= q->nbkt) {
+	n = (i < 2*q->nbkt) ? 2*q->nbkt : i+1;
+	q->bkt = realloc(q->bkt, n * sizeof(QBucket));
+	if(!q->bkt)
+	    DIE("Out of memory for " IFMT " buckets", n);
+	memset(q->bkt + q->nbkt, 0, (n - q->nbkt) * sizeof(QBucket));
+	q->nbkt = n;
+    }
+    b = &q->bkt[i];
+    if(!(c = b->last) || c->tail == QCHUNK) {
+	if((c = q->free))
+	    q->free = c->next;
+	else
+	    c = safe_malloc(sizeof(QChunk));
+	c->next = NULL;
+	c->head = c->tail = 0;
+	if(b->last)
+	    b->last->next = c;
+	else
+	    b->first = c;
+	b->last = c;
+    }
+    c->sp[c->tail++] = sp;
+    if(i < q->min)
+	q->min = i; // the heuristic is not consistent so this happens
+    q->num++;
+}
+
+void queue_push(Queue *q, StatePtr sp, float pri)
+{
+    if(q->type == QUEUE_BUCKET) {
+	pthread_mutex_lock(&q->lock);
+	bucket_push(q, sp, pri);
+	pthread_mutex_unlock(&q->lock);
+	return;
+    }
+    if(q->type == QUEUE_MULTI) {
+	multi_push(q, sp, pri);
+	return;
+    }
+    pthread_mutex_lock(&q->lock);
+    if(!heap_push(q, sp, pri))
+	DIE("Queue FULL");
     pthread_mutex_unlock(&q->lock);
 }
 
@@ -88,22 +250,18 @@ static inline int get_min(PQNode *nset)
 {
     int i, min=0;
     for(i=1; i < QFANOUT; i++) {
-        if(nset[i].pri < nset[min].pri)
-            min = i;
+	if(nset[i].pri < nset[min].pri)
+	    min = i;
     }
     return min;
 }
 
-/** returns the StatePtr with the minimal priority
+/** Pop from a single heap, the caller holds the lock
  */
-StatePtr queue_pop(Queue *q)
+static StatePtr heap_pop(Queue *q)
 {   
-    pthread_mutex_lock(&q->lock);
-
-    if(q->num == 0) {
-	pthread_mutex_unlock(&q->lock);
-        return 0;
-    }
+    if(q->num == 0)
+	return 0;
 
     // Remove the last one
     PQNode tail = q->pq[--q->num];
@@ -113,23 +271,104 @@ StatePtr queue_pop(Queue *q)
     PQNode min_node, *parent = &min_node;
     Iint set = 0, min, i, nsets = q->num / QFANOUT + !!(q->num % QFANOUT);
     while(set < nsets) {
-        // find min of the current set
-        min = get_min2(q->pq + QFANOUT * set);
-        i = QFANOUT * set + min;
-        if(tail.pri <= q->pq[i].pri)
-            break;
-        // next level down
-        *parent = q->pq[i];
-        parent = &q->pq[i];
-        set = i + 1;
+	// find min of the current set
+	min = get_min2(q->pq + QFANOUT * set);
+	i = QFANOUT * set + min;
+	if(tail.pri <= q->pq[i].pri)
+	    break;
+	// next level down
+	*parent = q->pq[i];
+	parent = &q->pq[i];
+	set = i + 1;
     }
     *parent = tail;
-    
-    pthread_mutex_unlock(&q->lock);
-
     return min_node.sp;
 }
 
+/** heap_pop one of a MultiQueue's heaps and refresh its top.
+ * The first QFANOUT entries are the roots so the min is among them.
+ */
+static StatePtr multi_heap_pop(Queue *h)
+{
+    StatePtr sp = heap_pop(h);
+    h->top = h->pq[get_min2(h->pq)].pri;
+    return sp;
+}
+
+/** Pop from the better top of two random heaps.
+ * Only returns 0 once every heap has been seen empty.
+ */
+static StatePtr multi_pop(Queue *q)
+{
+    int i;
+    Queue *a, *b;
+    StatePtr sp;
+    for(i=0; i < 2*q->nsub; i++) {
+	a = &q->sub[qrand() % q->nsub];
+	b = &q->sub[qrand() % q->nsub];
+	if(b->top < a->top) // racy peek, it is only a hint
+	    a = b;
+	if(!a->num || pthread_mutex_trylock(&a->lock))
+	    continue;
+	sp = multi_heap_pop(a);
+	pthread_mutex_unlock(&a->lock);
+	if(sp)
+	    goto found;
+    }
+    // probably empty. make sure
+    for(i=0; i < q->nsub; i++) {
+	a = &q->sub[i];
+	pthread_mutex_lock(&a->lock);
+	sp = multi_heap_pop(a);
+	pthread_mutex_unlock(&a->lock);
+	if(sp)
+	    goto found;
+    }
+    return 0;
+found:
+    __sync_fetch_and_sub(&q->num, 1);
+    return sp;
+}
+
+/** Take the oldest entry of the lowest bucket, the caller holds the lock
+ */
+static StatePtr bucket_pop(Queue *q)
+{
+    QBucket *b;
+    QChunk *c;
+    StatePtr sp;
+
+    if(q->num == 0)
+	return 0;
+    while(!q->bkt[q->min].first)
+	q->min++;
+    b = &q->bkt[q->min];
+    c = b->first;
+    sp = c->sp[c->head++];
+    if(c->head == c->tail) { // used up. recycle it
+	if(!(b->first = c->next))
+	    b->last = NULL;
+	c->next = q->free;
+	q->free = c;
+    }
+    q->num--;
+    return sp;
+}
+
+/** returns the StatePtr with the minimal priority
+ * (or close to it for QUEUE_MULTI and QUEUE_BUCKET)
+ */
+StatePtr queue_pop(Queue *q)
+{   
+    StatePtr sp;
+    if(q->type == QUEUE_MULTI)
+	return multi_pop(q);
+    pthread_mutex_lock(&q->lock);
+    sp = (q->type == QUEUE_BUCKET) ? bucket_pop(q) : heap_pop(q);
+    pthread_mutex_unlock(&q->lock);
+    return sp;
+}
+
 int queue_test(void)
 {
     int i, e = 0, size=1<<15;
@@ -139,18 +378,18 @@ int queue_test(void)
     queue_init(&q, size);
 
     for(i=0; i<size; i++) {
-        z = rand()%100;
-        queue_push(&q, z,z);
+	z = rand()%100;
+	queue_push(&q, z,z);
     }
     for(i=0; i<size; i++) {
-        a = queue_pop(&q);
-        if(a < b)
-            e |= 0x1;
-        b=a;
+	a = queue_pop(&q);
+	if(a < b)
+	    e |= 0x1;
+	b=a;
     }
 
     if(q.num != 0) 
-        e |= 0x2;
+	e |= 0x2;
     
     queue_pop(&q); // test for zero pop
 
@@ -158,5 +397,126 @@ int queue_test(void)
     return e;
 }
 
+typedef struct {
+    pthread_t thread;
+    Queue *q;
+    Iint ops;      // pops to do
+    u32 seed;
+    int *fen;      // counts per priority (Fenwick tree) or NULL
+    double rerr;   // sum of rank errors
+    Iint rmax;     // worst rank error
+} BenchArg;
 
+#define QB_PRI (1<<20) // priorities are integers below this
 
+static void fen_add(int *fen, int p, int d)
+{
+    for(p++; p <= QB_PRI; p += p & -p)
+	__sync_fetch_and_add(&fen[p-1], d);
+}
+
+/** Number of queued entries with priority below \a p
+ */
+static Iint fen_below(int *fen, int p)
+{
+    Iint n = 0;
+    for(; p > 0; p -= p & -p)
+	n += fen[p-1];
+    return n;
+}
+
+static void bench_push(BenchArg *a, int p)
+{
+    if(p >= QB_PRI)
+	p = QB_PRI-1;
+    if(a->fen)
+	fen_add(a->fen, p, 1);
+    queue_push(a->q, p+1, p);
+}
+
+/** Pop one, push two a little worse.  Like A* expanding a state
+ */
+static void *bench_thread(BenchArg *a)
+{
+    Iint j, r;
+    int p;
+    for(j=0; j < a->ops; j++) {
+	StatePtr sp = queue_pop(a->q);
+	if(!sp)
+	    continue;
+	p = sp - 1;
+	if(a->fen) {
+	    r = fen_below(a->fen, p);
+	    a->rerr += r;
+	    if(r > a->rmax)
+		a->rmax = r;
+	    fen_add(a->fen, p, -1);
+	}
+	bench_push(a, p + rand_r(&a->seed) % 4);
+	bench_push(a, p + rand_r(&a->seed) % 4);
+    }
+    return NULL;
+}
+
+/** Run the bench once.  Returns seconds taken
+ */
+static double bench_run(int type, int nthreads, Iint n, BenchArg *args, int *fen)
+{
+    int i;
+    Queue q;
+    struct timespec t1, t2;
+    BenchArg pre = {0};
+
+    if(type == QUEUE_MULTI)
+	queue_init_multi(&q, QFANOUT*(n/QFANOUT), QMULTI_C*nthreads);
+    else if(type == QUEUE_BUCKET)
+	queue_init_bucket(&q);
+    else
+	queue_init(&q, QFANOUT*(n/QFANOUT));
+    pre.q = &q;
+    pre.fen = fen;
+    pre.seed = 1;
+    for(i=0; i < n/4; i++)
+	bench_push(&pre, rand_r(&pre.seed) % 1024);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for(i=0; i < nthreads; i++) {
+	args[i].q = &q;
+	args[i].ops = n / 2 / nthreads;
+	args[i].seed = i+1;
+	args[i].fen = fen;
+	args[i].rerr = 0;
+	args[i].rmax = 0;
+	pthread_create(&args[i].thread, NULL, (ThreadMain)bench_thread, &args[i]);
+    }
+    for(i=0; i < nthreads; i++)
+	pthread_join(args[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    queue_fini(&q);
+    return (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+}
+
+/** Time n/2 pops and n pushes split across \a nthreads, then run it again
+ * counting how many better entries were in the queue at every pop.
+ */
+void queue_bench(int type, int nthreads, Iint n)
+{
+    int i;
+    double secs, rerr = 0;
+    Iint rmax = 0, pops = n / 2 / nthreads * nthreads;
+    BenchArg *args = safe_malloc(sizeof(BenchArg) * nthreads);
+    int *fen = calloc(QB_PRI, sizeof(int));
+
+    secs = bench_run(type, nthreads, n, args, NULL);
+    bench_run(type, nthreads, n, args, fen);
+    for(i=0; i < nthreads; i++) {
+	rerr += args[i].rerr;
+	if(args[i].rmax > rmax)
+	    rmax = args[i].rmax;
+    }
+    printf("%-6s %3d threads: %7.2f Mops/s  rank error avg %.2f max " IFMT "\n",
+	    type == QUEUE_MULTI ? "multi" : type == QUEUE_BUCKET ? "bucket" : "heap", nthreads, pops * 3 / secs / 1e6,
+	    rerr / pops, rmax);
+    free(fen);
+    free(args);
+}
@@ -7,29 +7,60 @@
 #define QFANOUT (CACHE_LINE / sizeof(PQNode))
 #define PRIORITY_MAX 1e100
 
+#define QUEUE_HEAP 0   // one 8-ary heap behind a mutex
+#define QUEUE_MULTI 1  // MultiQueue: pop the better of two random heaps
+#define QUEUE_BUCKET 2 // FIFO buckets of quantized priority, grows as needed
+#define QMULTI_C 4     // heaps per thread in a MultiQueue
+#define QBUCKET_SCALE 4 // buckets per unit of priority
+#define QCHUNK 60      // StatePtrs per bucket chunk
+
 typedef struct s_PQNode PQNode;
+typedef struct s_QChunk QChunk;
 
 struct s_PQNode {
     float pri; // priority in queue
     StatePtr sp; // pointer to this state
 };
 
+/** A piece of a bucket's FIFO
+ */
+struct s_QChunk {
+    QChunk *next;
+    u32 head, tail; // pop from head, push at tail
+    StatePtr sp[QCHUNK];
+};
+
+typedef struct {
+    QChunk *first, *last;
+} QBucket;
+
 /** Priority queue
  */
 struct s_PQueue {
+    int type;   // QUEUE_*
     Iint len;   // sizeof pq
     Iint brk;   // first virgin mem
     Iint num;   // number of items in the queue
     pthread_mutex_t lock;
     PQNode *pqraw,*pq; // fanout of QFANOUT
+    int nsub;   // QUEUE_MULTI: number of heaps
+    Queue *sub; // QUEUE_MULTI: the heaps themselves
+    float top;  // QUEUE_MULTI: a heap's min priority, written under its lock
+    QBucket *bkt; // QUEUE_BUCKET: one per QBUCKET_SCALE'th of priority
+    Iint nbkt;  // QUEUE_BUCKET: buckets allocated
+    Iint min;   // QUEUE_BUCKET: every bucket below this is empty
+    QChunk *free; // QUEUE_BUCKET: spare chunks
 };
 
 void queue_init(Queue *q, Iint size);
+void queue_init_multi(Queue *q, Iint size, int nsub);
+void queue_init_bucket(Queue *q);
 void queue_fini(Queue *q);
 void queue_push(Queue *q, StatePtr sp, float pri);
 StatePtr queue_pop(Queue *q);
 int queue_mem1k(void);
 int queue_test(void);
+void queue_bench(int type, int nthreads, Iint n);
 
 #endif
 
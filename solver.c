@@ -22,7 +22,12 @@ get_path(state1, state2)
 #include <time.h>
 #include <math.h>
 #include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+#include <dirent.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "list.h"
 #include "solver.h"
 #include "state.h"
@@ -30,223 +35,1750 @@ get_path(state1, state2)
 
 #define TYPE(t) list_el(PieceType, ks->bd.types, t)
 
-/** This calculates a huristic value.
+// a mailbox record is [hash][priority][StateFull]
+#define REC_HASH(rec) (*(u64*)(rec))
+#define REC_PRI(rec) (*(float*)((char*)(rec) + sizeof(u64)))
+#define REC_STATE(rec) ((StateFull*)((char*)(rec) + sizeof(u64) + sizeof(float)))
+
+/** What state_adj works out about the state it expands.  One per state
+ * being expanded (they are scratch space).  state_huristic scores its
+ * successors by patching occ with each move and putting it back.
+ */
+typedef struct {
+    u16 *pcs;  // the state expanded
+    u16 *flip; // scratch for state_canon
+    u64 *occ;  // board_occupy bitboard
+    u16 *sps;  // the spaces, smallest first
+    u16 *own;  // the piece on each cell (only good on the pieces' cells)
+    u16 *mv;   // moves found, piece*4 + dir
+    int clump; // state_clump of pcs (-1 until state_huristic wants it)
+    u16 *touch; // cells a move changes and the cells next to them
+    u32 *seen, stamp; // cells already in touch have seen == stamp
+} Cells;
+
+static void cells_init(Solver *ks, Cells *cs)
+{
+    int ncells = ks->bd.w * ks->bd.h;
+    cs->pcs = safe_malloc(sizeof(u16) * ks->bd.npcs);
+    cs->flip = safe_malloc(sizeof(u16) * ks->bd.npcs);
+    cs->occ = safe_malloc(sizeof(u64) * ks->bd.nwords);
+    cs->sps = safe_malloc(sizeof(u16) * ks->bd.nsp);
+    cs->own = safe_malloc(sizeof(u16) * ncells);
+    cs->mv = safe_malloc(sizeof(u16) * 4*ks->bd.nsp);
+    cs->touch = safe_malloc(sizeof(u16) * ncells);
+    cs->seen = safe_malloc(sizeof(u32) * ncells);
+    memset(cs->seen, 0, sizeof(u32) * ncells);
+    cs->stamp = 0;
+    cs->clump = -1;
+}
+
+static void cells_fini(Cells *cs)
+{
+    free(cs->pcs);
+    free(cs->flip);
+    free(cs->occ);
+    free(cs->sps);
+    free(cs->own);
+    free(cs->mv);
+    free(cs->touch);
+    free(cs->seen);
+}
+
+/** What space \a c adds to the clumping score on \a occ (0 if it isn't one)
+ */
+static inline int clump_cell(Board *bd, u64 *occ, int c)
+{
+    int d, n = 0; // number of spaces adjacent to this space ('-' doesn't count)
+    if(bits_get(occ, c))
+	return 0;
+    for(d=0; d < 4; d++)
+	n += !bits_get(occ, c + bd->dir[d]) && !bits_get(bd->locked, c + bd->dir[d]);
+    return 1 << n; // favor adjacent spaces exponentally
+}
+
+/** How clumped the spaces of the state \a cs was filled from are.
+ * nsp <= clump < nsp*16
+ */
+static int state_clump(Solver *ks, Cells *cs)
+{
+    int k, sp = 0;
+    for(k=0; k < ks->bd.nsp; k++)
+	sp += clump_cell(&ks->bd, cs->occ, cs->sps[k]);
+    return sp;
+}
+
+/** Add \a c and the cells next to it to cs->touch (\a n of them so far)
+ */
+static inline void touch_cell(Board *bd, Cells *cs, int *n, int c)
+{
+    int d, x;
+    for(d=0; d < 5; d++) {
+	x = d < 4 ? c + bd->dir[d] : c;
+	if(cs->seen[x] != cs->stamp) {
+	    cs->seen[x] = cs->stamp;
+	    cs->touch[(*n)++] = x;
+	}
+    }
+}
+
+/** state_clump after moving piece \a ipcs of cs->pcs in \a dir.  Only the
+ * cells the move changes and the ones next to them can score differently,
+ * so this costs the size of the piece's edges and not the board.
+ */
+static int move_clump(Solver *ks, Cells *cs, int ipcs, int dir)
+{
+    Board *bd = &ks->bd;
+    int k, f, c, n = 0, t = bd->ptype[ipcs], sp = cs->clump;
+    int loc = cs->pcs[ipcs];
+    int in0 = bd->edgeat[t*4 + dir], in1 = bd->edgeat[t*4 + dir + 1];
+    int out0 = bd->edgeat[t*4 + (dir^2)], out1 = bd->edgeat[t*4 + (dir^2) + 1];
+
+    if(!++cs->stamp) { // wrapped
+	memset(cs->seen, 0, sizeof(u32) * bd->w * bd->h);
+	cs->stamp = 1;
+    }
+    // it moves into its edge that way and out of the cells in front of the
+    // edge behind it
+    for(f=in0; f < in1; f++)
+	touch_cell(bd, cs, &n, loc + bd->edges[f]);
+    for(f=out0; f < out1; f++)
+	touch_cell(bd, cs, &n, loc + bd->edges[f] + bd->dir[dir]);
+    for(k=0; k < n; k++)
+	sp -= clump_cell(bd, cs->occ, cs->touch[k]);
+    // make the move on occ, score it and put occ back
+    for(f=in0; f < in1; f++) {
+	c = loc + bd->edges[f];
+	cs->occ[c >> 6] ^= 1ULL << (c & 63);
+    }
+    for(f=out0; f < out1; f++) {
+	c = loc + bd->edges[f] + bd->dir[dir];
+	cs->occ[c >> 6] ^= 1ULL << (c & 63);
+    }
+    for(k=0; k < n; k++)
+	sp += clump_cell(bd, cs->occ, cs->touch[k]);
+    for(f=in0; f < in1; f++) {
+	c = loc + bd->edges[f];
+	cs->occ[c >> 6] ^= 1ULL << (c & 63);
+    }
+    for(f=out0; f < out1; f++) {
+	c = loc + bd->edges[f] + bd->dir[dir];
+	cs->occ[c >> 6] ^= 1ULL << (c & 63);
+    }
+    return sp;
+}
+
+/** This calculates a huristic value for \a fs, a successor state_adj
+ * found from \a cs.
  */
-static float state_huristic(Solver *ks, u16 *pcs, u8 *grid)
+static float state_huristic(Solver *ks, StateFull *fs, Cells *cs)
 {
-    int i, d, lsp, sp=0, t;
-    int dy = (pcs[0] / ks->bd.w) - (ks->bd.end / ks->bd.w);
-    int dx = (pcs[0] % ks->bd.w) - (ks->bd.end % ks->bd.w);
+    int dy = (fs->pcs[0] / ks->bd.w) - (ks->bd.end / ks->bd.w);
+    int dx = (fs->pcs[0] % ks->bd.w) - (ks->bd.end % ks->bd.w);
     // distance to finish
     float dist = fabs(dx) + fabs(dy);
 
     // we would like to favor clumped spaces
-    // calculate variance of spaces
-    for(i=0, t=0; t < ks->bd.nsp; i++) {
-	if(grid[i] & 0x7F)
-	    continue; // only looking for spaces
-	lsp = 0; // number of spaces adjacent to this space
-	for(d=0; d < 4; d++) {
-	    if(grid[i + ks->bd.dir[d]] == 0)
-		lsp ++;
-	}
-	sp += (1<<lsp); // favor adjacent spaces exponentally
-	t++; // counting found spaces
-    }
-    // nsp <= sp < nsp*16
+    if(cs->clump < 0)
+	cs->clump = state_clump(ks, cs);
+    int sp = move_clump(ks, cs, fs->semi.ipcs, fs->semi.dir);
     float spscore = (float)(sp - ks->bd.nsp) / (ks->bd.nsp*15); // 0.0 - 1.0
     return dist + (1.0 - spscore); // lower is better
 }
 
+/** Keep \a fs or its mirror image, whichever hashes lower.  \a zh is
+ * board_hash of fs and gets that of the one kept.  \a zm is the hash of
+ * the mirror image.  \a tmp has room for a pcs
+ */
+static inline void state_canon(Board *bd, StateFull *fs, u64 *zh, u64 zm, u16 *tmp)
+{
+    if(zm > *zh)
+	return;
+    if(zm == *zh) { // most likely fs is its own mirror image
+	memcpy(tmp, fs->pcs, 2*bd->npcs);
+	board_mirror(bd, tmp);
+	if(memcmp(tmp, fs->pcs, 2*bd->npcs) >= 0)
+	    return;
+    }
+    board_mirror(bd, fs->pcs);
+    fs->semi.mirror = 1;
+    *zh = zm;
+}
 
-/** This calculates all adjacent states to @s and puts them in @a adj
+/** The move generator behind state_adj.  It is always inlined, once with
+ * \a small set and once without, so each board size gets its own copy with
+ * the other case and the word loops compiled out.  On a small board the
+ * whole bitboard is one u64.
  */
-void state_adj(Solver *ks, List *adjs, u16 *pcs, u8 *grid, u8 *pmov)
+static inline __attribute__((always_inline))
+void adj_kernel(Solver *ks, List *adjs, u64 *hashes, u16 *pcs, u64 hash, Cells *cs, const int small)
 {
-    int i, d, t,j;
+    Board *bd = &ks->bd;
+    int i, j, k, d, c, s, t, n = 0, ns, nc = bd->w * bd->h;
+    int mirror = ks->mirror && hashes;
+    u16 m;
+    u64 zh, sp, hm = 0;
     StateFull *fs;
-    memset(pmov, 0, ks->bd.npcs);
 
-    list_clear(adjs);
+    memcpy(cs->pcs, pcs, 2*bd->npcs);
+    cs->clump = -1;
+    board_occupy(bd, pcs, cs->occ, small);
+    if(small) {
+	sp = ~cs->occ[0];
+	if(bd->w * bd->h < 64)
+	    sp &= (1ULL << (bd->w * bd->h)) - 1;
+	for(ns=0; sp; sp &= sp - 1)
+	    cs->sps[ns++] = __builtin_ctzll(sp);
+    } else
+	ns = board_spaces(bd, cs->occ, cs->sps);
+    for(i=0; i < bd->npcs; i++) {
+	t = bd->ptype[i];
+	for(j=bd->fragat[t]; j < bd->fragat[t+1]; j++)
+	    cs->own[pcs[i] + bd->frags[j]] = i;
+    }
 
-    // Find all the spaces and mark adjacent pieces
-    for(i=0, t=0; t < ks->bd.nsp; i++) {
-	if(grid[i]&0x7F)
-	    continue; // we are only looking for spaces
-	for(d=0; d<4; d++) { // all 4 directions
-	    j = grid[i + ks->bd.dir[d^2]]; // opposite direction
-	    if(j!=0 && !(j&0x80)) // not wall or space
-		pmov[j-1] |= (1<<d); // mark it for later
+    for(k=0; k < ns; k++) {
+	s = cs->sps[k];
+	for(d=0; d<4; d++) { // a piece behind s could move into it
+	    c = s - bd->dir[d];
+	    if(!bits_get(cs->occ, c) || bits_get(bd->walls, c))
+		continue;
+	    i = cs->own[c];
+	    t = bd->ptype[i];
+	    if(s != pcs[i] + bd->edges[bd->edgeat[t*4 + d]] || !board_can_move(bd, cs->occ, t, pcs[i], d, small))
+		continue;
+	    // keep them in piece order (so the search doesn't change)
+	    for(j=n++; j > 0 && cs->mv[j-1] > i*4 + d; j--)
+		cs->mv[j] = cs->mv[j-1];
+	    cs->mv[j] = i*4 + d;
 	}
-	t++; // count found spaces
     }
 
-    // try to move marked pieces
-    for(i=0, t=0; i < ks->bd.npcs; t += (i == TYPE(t).last), i++) {
-	if(!pmov[i]) // quick abort
-	    continue;
-	for(d=0; d<4; d++) { // All 4 directions
-	    if((pmov[i] & (1<<d)) &&
-		    board_can_move(&ks->bd, grid, t, pcs[i], d)) {
-		
-		// add to the list of adj states
-		fs = &listv_push(StateFull, adjs);
-		memcpy(fs->pcs, pcs, 2*ks->bd.npcs);
-		fs->semi.ipcs = i;
-		fs->semi.dir = d;
-		board_apply_move(&ks->bd, fs->pcs, i, d);
-		board_assert_sorted(&ks->bd, fs->pcs);
-	    }
+    if(mirror)
+	hm = board_mirror_hash(bd, pcs);
+    // room for them all at once
+    list_clear(adjs);
+    if(n)
+	list_append(adjs, n);
+    for(j=0; j < n; j++) {
+	m = cs->mv[j];
+	// add to the list of adj states
+	fs = &listv_el(StateFull, adjs, j);
+	memcpy(fs->pcs, pcs, 2*bd->npcs);
+	fs->semi.ipcs = m >> 2;
+	fs->semi.dir = m & 3;
+	fs->semi.mirror = 0;
+	zh = board_apply_move(bd, fs->pcs, m >> 2, m & 3);
+	if(hashes)
+	    hashes[j] = hash ^ zh;
+	if(mirror) { // the mirror image's hash moves with the mirrored piece
+	    i = m >> 2;
+	    t = bd->ptype[i];
+	    state_canon(bd, fs, &hashes[j], hm ^ bd->zob[t*nc + bd->mloc[t*nc + pcs[i]]]
+		    ^ bd->zob[t*nc + bd->mloc[t*nc + pcs[i] + bd->dir[m & 3]]], cs->flip);
 	}
+#if LOG_LEVEL >= LEV_DEBUG
+	board_assert_sorted(bd, fs->pcs);
+#endif
     }
 }
 
+/** This calculates all adjacent states to @s and puts them in @a adj
+ * @a hashes gets the board_hash of each one, worked out from @a hash
+ * (it can be NULL).  @a cs gets the cells of @a pcs.  With ks->mirror (and
+ * hashes) a successor may come out flipped, see StateSemi.mirror.
+ *
+ * We start from the spaces.  A piece can only move into one if it is next
+ * to it, and every move is found from the first cell of the edge it moves
+ * into, so only the pieces next to a space get tested.
+ */
+void state_adj(Solver *ks, List *adjs, u64 *hashes, u16 *pcs, u64 hash, Cells *cs)
+{
+    if(ks->bd.small)
+	adj_kernel(ks, adjs, hashes, pcs, hash, cs, 1);
+    else
+	adj_kernel(ks, adjs, hashes, pcs, hash, cs, 0);
+}
+
+/** Sleep while *addr == val (for at most ms milliseconds if ms > 0)
+ */
+static void futex_wait(volatile int *addr, int val, int ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, ms > 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(volatile int *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/** The search is over.  Wake everyone up
+ */
+static void solver_done(Solver *ks)
+{
+    ks->done = 1;
+    __sync_fetch_and_add(&ks->wake, 1); // so no one goes to sleep
+    futex_wake(&ks->wake, INT_MAX);
+    futex_wake(&ks->done, INT_MAX);
+}
 
+/** Record the end state.  The first one found wins
+ */
+static void solver_found(Solver *ks, StatePtr sp)
+{
+    if(__sync_bool_compare_and_swap(&ks->solution, 0, sp))
+	solver_done(ks);
+}
 
-StatePtr stall(Solver *ks)
+/** Where thread \a i keeps the states it has yet to look at
+ */
+static inline Queue *frontier(Solver *ks, int i)
 {
+    return ks->opts.queue == QUEUE_MULTI ? &ks->pq : &ks->threads[i].pq;
+}
+
+/** Out of work.  Take a state from another thread's frontier or wait for
+ * one to show up.  Returns 0 once the search is over.
+ *
+ * ks->idle counts threads that have nothing and are not looking, so when
+ * it reaches nthreads every frontier is empty for good.
+ */
+static StatePtr solver_steal(Solver *ks, ThreadState *ts)
+{
+    int i, seq, n = ks->nthreads;
     StatePtr sp = 0;
-    
-    while(sp == 0) {
-	pthread_mutex_lock(&ks->alock);
-	ks->active_threads--; // take ourselves out of the game
-	pthread_mutex_unlock(&ks->alock);
-	usleep(1000); // wait on other threads for a bit
-	// is the game over?
-	pthread_mutex_lock(&ks->alock);
-	if(!ks->active_threads) {
-	    pthread_mutex_unlock(&ks->alock); 
-	    return 0; // all the other threads are done. so are we.
-	}
-	ks->active_threads ++; // lets keep trying
-	pthread_mutex_unlock(&ks->alock);
-	// try to pop a state
-	sp = queue_pop(&ks->pq);
-    }
-    // Were back in the game
+
+    if(__sync_add_and_fetch(&ks->idle, 1) == n)
+	solver_done(ks);
+    __sync_fetch_and_add(&ks->sleepers, 1);
+    while(1) {
+	seq = ks->wake;
+	if(ks->done)
+	    break;
+	__sync_fetch_and_sub(&ks->idle, 1); // busy while we look
+	for(i=1; i <= n && !sp; i++)
+	    sp = queue_pop(frontier(ks, (ts->i + i) % n));
+	if(sp)
+	    break;
+	if(__sync_add_and_fetch(&ks->idle, 1) == n) {
+	    solver_done(ks);
+	    break;
+	}
+	futex_wait(&ks->wake, seq, 0);
+    }
+    __sync_fetch_and_sub(&ks->sleepers, 1);
     return sp;
 }
 
-/** Solve via a bfs search
+/** A thread's scratch for expanding up to SOLVER_POP states at a time
  */
-static void *solver_thread(ThreadState *tstate)
+typedef struct {
+    int n;                  // successors of the last solver_expand
+    Cells cells[SOLVER_POP]; // of each state expanded
+    u64 *hashes;
+    List adjs[SOLVER_POP];  // type StateFull
+    StateFull **nfsv;       // the successors, over all the adjs
+    StatePtr *adjp;         // where state_insert_batch put them
+    int *rets;              // and what it said
+    int *from;              // which of the states they came from
+    StateFull *cfs;
+} Expand;
+
+static void expand_init(Solver *ks, Expand *ex, int sizeof_full)
 {
-    int i, ret;
-    Solver *ks = tstate->ks;
-    StatePtr sp, adjp;
-    u8 *grid, *pmov;
-    List adjs; // type StateFull
-    StateFull *nfs, *cfs = alloca(ks->states.sizeof_full);
+    int k, nmax = SOLVER_POP * 4*ks->bd.npcs; // most successors of a batch
+    ex->hashes = safe_malloc(sizeof(u64) * nmax);
+    ex->nfsv = safe_malloc(sizeof(StateFull*) * nmax);
+    ex->adjp = safe_malloc(sizeof(StatePtr) * nmax);
+    ex->rets = safe_malloc(sizeof(int) * nmax);
+    ex->from = safe_malloc(sizeof(int) * nmax);
+    ex->cfs = safe_malloc(sizeof_full);
+    for(k=0; k < SOLVER_POP; k++) {
+	cells_init(ks, &ex->cells[k]);
+	list_init(&ex->adjs[k], sizeof_full, 4*ks->bd.nsp);
+    }
+}
 
-    grid = safe_malloc(ks->bd.w * ks->bd.h);
-    pmov = safe_malloc(ks->bd.npcs);
+static void expand_fini(Expand *ex)
+{
+    int k;
+    for(k=0; k < SOLVER_POP; k++) {
+	list_fini(&ex->adjs[k]);
+	cells_fini(&ex->cells[k]);
+    }
+    free(ex->hashes);
+    free(ex->nfsv);
+    free(ex->adjp);
+    free(ex->rets);
+    free(ex->from);
+    free(ex->cfs);
+}
 
-    // initilize adjacent states
-    list_init(&adjs, ks->states.sizeof_full, 4*ks->bd.nsp);
+/** Insert the successors of the \a np states at \a sp as one batch.
+ * Returns how many there were (ex->nfsv, ex->rets, ...)
+ */
+static int solver_expand(Solver *ks, ThreadState *ts, Expand *ex, StatePtr *sp, int np)
+{
+    int i, k, n;
+    StateSet *ss = ks->states;
+    StateFull *nfs, *cfs = ex->cfs;
 
-    // proccess states from the top of the priority queue
-    while(1) {
-	if(ks->solution)
-	    break; // I guess someone else found a solution
-	sp = queue_pop(&ks->pq);
-	if(!sp) { // others might still be processing so just wait
-	    sp = stall(ks);
-	    if(!sp) // everyone is done
-		break;
-	}
-	// We got a state so go ahead
-	state_ref(&ks->states, &ks->bd, sp, cfs);
-	tstate->dpth = cfs->depth;
-	// create an intermediate grid for other algorithms to use
-	board_fill(&ks->bd, cfs->pcs, grid);
+    for(k=0, n=0; k < np; k++) {
+	state_ref(ss, &ks->bd, sp[k], cfs);
+	ts->dpth = cfs->depth;
 	//get adjacent states
-	state_adj(ks, &adjs, cfs->pcs, grid, pmov);	
-	// process each adjacent state
-	for(i=0; i < adjs.length; i++) {
-	    tstate->num++;
-	    nfs = &listv_el(StateFull, &adjs, i);
+	state_adj(ks, &ex->adjs[k], ex->hashes+n, cfs->pcs, board_hash(&ks->bd, cfs->pcs),
+		&ex->cells[k]);
+	for(i=0; i < ex->adjs[k].length; i++, n++) {
+	    ts->num++;
+	    nfs = ex->nfsv[n] = &listv_el(StateFull, &ex->adjs[k], i);
 	    nfs->semi.idx_next = 0;
-	    nfs->semi.node = ks->states.node;
-	    nfs->semi.parent = sp;
+	    nfs->semi.node = ss->node;
+	    nfs->semi.parent = sp[k];
 	    nfs->depth = cfs->depth+1;
-	    while((ret = state_insert(&ks->states, &ks->bd, nfs, &adjp)) < 0)
-		tstate->oops++; // just keep trying
-	    if(ret > 0) { // dup or sent to different node
+	    ex->from[n] = k;
+	}
+    }
+    ts->oops += state_insert_batch(ss, &ks->bd, ex->nfsv, ex->hashes, n, ex->adjp, ex->rets);
+    return ex->n = n;
+}
+
+/** Solve via a best first (astar) search
+ * Every thread works on its own frontier and steals when it runs dry.
+ */
+static void *solver_thread(ThreadState *tstate)
+{
+    int i, n, np, pushed;
+    Solver *ks = tstate->ks;
+    Queue *front = frontier(ks, tstate->i);
+    StatePtr sp[SOLVER_POP];
+    StateFull *nfs;
+    Expand ex;
+
+    numa_pin(tstate->i, ks->nthreads);
+    state_thread(ks->states, &tstate->rs);
+    expand_init(ks, &ex, ks->states->sizeof_full);
+
+    // proccess states from the top of the priority queue
+    while(!ks->done) {
+	if(!(sp[0] = queue_pop(front)) && !(sp[0] = solver_steal(ks, tstate)))
+	    break; // everyone is done
+	// take a few more if we have them so their successors go in together
+	for(np=1; np < SOLVER_POP && (sp[np] = queue_pop(front)); np++);
+	n = solver_expand(ks, tstate, &ex, sp, np);
+	// process each adjacent state
+	for(i=0, pushed=0; i < n; i++) {
+	    if(ex.rets[i] > 0) { // dup or sent to different node
 		tstate->dup++;
 		continue;
 	    }
+	    nfs = ex.nfsv[i];
 	    // is this a solution?
-	    if(nfs->pcs[0] == ks->bd.end) {
-		ks->solution = adjp;
-	    }
+	    if(nfs->pcs[0] == ks->bd.end)
+		solver_found(ks, ex.adjp[i]);
 	    // this is a unique state add it to the queue for later processing
-	    float dist = state_huristic(ks, nfs->pcs, grid);
+	    float dist = state_huristic(ks, nfs, &ex.cells[ex.from[i]]);
 	    tstate->dist = dist;
-	    queue_push(&ks->pq, adjp, nfs->depth + dist);
+	    queue_push(front, ex.adjp[i], nfs->depth + dist);
+	    pushed = 1;
+	}
+	// let a waiting thread know there is something to steal
+	__sync_synchronize();
+	if(pushed && ks->sleepers) {
+	    __sync_fetch_and_add(&ks->wake, 1);
+	    futex_wake(&ks->wake, 1);
 	}
     }
     
-    list_fini(&adjs);
-    free(grid);
-    free(pmov);
+    expand_fini(&ex);
+    memcpy(tstate->hits, numa_hits, sizeof(numa_hits));
+    state_thread(ks->states, NULL);
     
     return NULL;
 }
 
-/** Solves the puzzle using nthreads
+/** Stop every partition, including the ones asleep on their mailbox
+ */
+static void hda_done(Solver *ks)
+{
+    int i;
+    ks->ctl->done = 1;
+    futex_wake(&ks->ctl->done, INT_MAX);
+    for(i=0; !ks->net && i < ks->nparts; i++)
+	mbox_wake(&ks->mbox[i]);
+}
+
+/** Record the end state.  The first one found wins
+ */
+static void hda_found(Solver *ks, int node, StatePtr sp)
+{
+    if(__sync_bool_compare_and_swap(&ks->ctl->found, 0, 1)) {
+	ks->ctl->solution = sp;
+	ks->ctl->solnode = node;
+	__sync_synchronize();
+	hda_done(ks);
+    }
+}
+
+/** Post the batch we are filling for \a node (if any)
+ */
+static void hda_flush(Solver *ks, ThreadState *ts, int node)
+{
+    MBatch *b = ts->out[node];
+    if(!b || !b->n)
+	return;
+    __sync_fetch_and_add(&ks->ctl->work, 1); // it is in flight until taken
+    if(ks->net) {
+	net_send(ks->net, node, NET_BATCH, 0, b->data, b->n);
+	b->n = 0;
+    } else {
+	mbox_post(&ks->mbox[node], b);
+	ts->out[node] = NULL;
+    }
+}
+
+/** Queue \a fs up for the partition \a node that owns it
+ */
+static void hda_send(Solver *ks, ThreadState *ts, int node, StateFull *fs, u64 zh, float pri)
+{
+    MBatch *b = ts->out[node];
+    if(!b)
+	b = ts->out[node] = mbox_batch(MBOX_BATCH, ks->rsize);
+    char *rec = b->data + b->n++ * ks->rsize;
+    REC_HASH(rec) = zh;
+    REC_PRI(rec) = pri;
+    memcpy(REC_STATE(rec), fs, ks->states->sizeof_full);
+    if(b->n == MBOX_BATCH)
+	hda_flush(ks, ts, node);
+}
+
+/** Follow up on state_insert putting \a fs in our partition (\a ret, \a sp)
+ */
+static void hda_place(Solver *ks, ThreadState *ts, StateFull *fs, u64 zh, float pri, int ret, StatePtr sp)
+{
+    if(ret == 2) { // it isn't ours
+	hda_send(ks, ts, sp, fs, zh, pri);
+	return;
+    }
+    if(ret == 1) {
+	ts->dup++;
+	return;
+    }
+    if(fs->pcs[0] == ks->bd.end)
+	hda_found(ks, ts->i, sp);
+    queue_push(&ts->pq, sp, pri);
+}
+
+/** Insert the \a n states \a fsv (hashes \a zhv) into our partition and
+ * open list as one state_insert_batch.  \a priv was worked out by whoever
+ * expanded their parents.  \a sps and \a rets have room for n
+ */
+static void hda_insert(Solver *ks, ThreadState *ts, StateFull **fsv, u64 *zhv, float *priv, int n,
+	StatePtr *sps, int *rets)
+{
+    int i;
+    ts->oops += state_insert_batch(&ks->states[ts->i], &ks->bd, fsv, zhv, n, sps, rets);
+    for(i=0; i < n; i++)
+	hda_place(ks, ts, fsv[i], zhv[i], priv[i], rets[i], sps[i]);
+}
+
+/** hda_insert the \a n mailbox records at \a recs, MBOX_BATCH at a time
+ */
+static void hda_insert_recs(Solver *ks, ThreadState *ts, char *recs, int n)
+{
+    StateFull *fsv[MBOX_BATCH];
+    u64 zhv[MBOX_BATCH];
+    float priv[MBOX_BATCH];
+    StatePtr sps[MBOX_BATCH];
+    int i, j, m, rets[MBOX_BATCH];
+
+    for(i=0; i < n; i += m) {
+	m = n-i < MBOX_BATCH ? n-i : MBOX_BATCH;
+	for(j=0; j < m; j++) {
+	    fsv[j] = REC_STATE(recs + (i+j) * ks->rsize);
+	    zhv[j] = REC_HASH(recs + (i+j) * ks->rsize);
+	    priv[j] = REC_PRI(recs + (i+j) * ks->rsize);
+	}
+	hda_insert(ks, ts, fsv, zhv, priv, m, sps, rets);
+    }
+}
+
+/** Insert everything other partitions sent us.
+ * Returns the number of batches taken
+ */
+static int hda_recv(Solver *ks, ThreadState *ts)
+{
+    MBatch *b, *next;
+    NetHdr *h;
+    int nb = 0;
+
+    if(ks->net) {
+	net_poll(ks->net, 0);
+	while((h = net_next(ks->net))) {
+	    if(h->type != NET_BATCH)
+		continue; // nobody asks for states until we are done
+	    hda_insert_recs(ks, ts, (char*)(h+1), h->n);
+	    nb++;
+	}
+	return nb;
+    }
+
+    b = mbox_take(&ks->mbox[ts->i]);
+    for(; b; b = next, nb++) {
+	next = b->next;
+	hda_insert_recs(ks, ts, b->data, b->n);
+	free(b);
+    }
+    return nb;
+}
+
+/** HDA*: this thread owns the partition states[ts->i].
+ * Successors that hash to another partition are batched off to its mailbox
+ * (or its process when there are several nodes).
+ *
+ * ctl->work counts busy threads plus batches in flight.  A batch's unit is
+ * handed to the thread that takes it, so it only reaches zero once every
+ * thread is idle with nothing in flight.
+ */
+static void *hda_thread(ThreadState *ts)
+{
+    int i, nb, seq = 0, idle = 0, nexp = 0;
+    Solver *ks = ts->ks;
+    StateSet *ss = &ks->states[ts->i];
+    StatePtr sp, *sps;
+    Cells cs;
+    u64 *hashes;
+    float *priv;
+    int *rets;
+    List adjs; // type StateFull
+    StateFull **nfsv, *nfs, *cfs = alloca(ss->sizeof_full);
+
+    numa_pin(ts->i, ks->nparts);
+    state_thread(ss, &ts->rs);
+    cells_init(ks, &cs);
+    // for the successors of a state
+    hashes = safe_malloc(sizeof(u64) * 4*ks->bd.npcs);
+    priv = safe_malloc(sizeof(float) * 4*ks->bd.npcs);
+    nfsv = safe_malloc(sizeof(StateFull*) * 4*ks->bd.npcs);
+    sps = safe_malloc(sizeof(StatePtr) * 4*ks->bd.npcs);
+    rets = safe_malloc(sizeof(int) * 4*ks->bd.npcs);
+    list_init(&adjs, ss->sizeof_full, 4*ks->bd.nsp);
+
+    while(!ks->ctl->done) {
+	if(!ks->net)
+	    seq = mbox_seq(&ks->mbox[ts->i]);
+	if((nb = hda_recv(ks, ts))) {
+	    // an idle thread turns one of the batches into its busy unit
+	    __sync_fetch_and_sub(&ks->ctl->work, nb - idle);
+	    idle = 0;
+	}
+	if(idle) {
+	    if(ks->net)
+		net_poll(ks->net, 10); // also keeps our output moving
+	    else if(!ks->ctl->done)
+		mbox_wait(&ks->mbox[ts->i], seq); // until a batch comes (or the end)
+	    continue;
+	}
+	if(!(sp = queue_pop(&ts->pq))) {
+	    // out of work. Make sure nobody is waiting on us first
+	    for(i=0; i < ks->nparts; i++)
+		hda_flush(ks, ts, i);
+	    idle = 1;
+	    if(__sync_sub_and_fetch(&ks->ctl->work, 1) == 0)
+		hda_done(ks);
+	    continue;
+	}
+	state_ref(ss, &ks->bd, sp, cfs);
+	ts->dpth = cfs->depth;
+	state_adj(ks, &adjs, hashes, cfs->pcs, board_hash(&ks->bd, cfs->pcs), &cs);
+	for(i=0; i < adjs.length; i++) {
+	    ts->num++;
+	    nfs = nfsv[i] = &listv_el(StateFull, &adjs, i);
+	    nfs->semi.idx_next = 0;
+	    nfs->semi.node = ts->i;
+	    nfs->semi.parent = sp;
+	    nfs->depth = cfs->depth+1;
+	    float dist = state_huristic(ks, nfs, &cs);
+	    ts->dist = dist;
+	    priv[i] = nfs->depth + dist;
+	}
+	hda_insert(ks, ts, nfsv, hashes, priv, adjs.length, sps, rets);
+	if(++nexp % MBOX_FLUSH == 0) {
+	    // don't let other partitions starve on a half full batch
+	    for(i=0; i < ks->nparts; i++)
+		hda_flush(ks, ts, i);
+	}
+    }
+
+    for(i=0; i < ks->nparts; i++)
+	free(ts->out[i]);
+    list_fini(&adjs);
+    cells_fini(&cs);
+    free(hashes);
+    free(priv);
+    free(nfsv);
+    free(sps);
+    free(rets);
+    memcpy(ts->hits, numa_hits, sizeof(numa_hits));
+    state_thread(ss, NULL);
+
+    return NULL;
+}
+
+/** Add \a r to the next layer.  Returns 0 if it was seen before
+ */
+static inline int direct_seen(Direct *dt, u32 r)
+{
+    u32 bit = 1u << (r & 31);
+    return __sync_fetch_and_or(&dt->seen[r >> 5], bit) & bit;
+}
+
+/** Append our batch of ranks to the next layer
+ */
+static void direct_flush(Direct *dt, u32 *buf, int n)
+{
+    pthread_mutex_lock(&dt->lock);
+    if(dt->nnext + n > dt->capnext) {
+	// only next grows here, the others are still reading cur
+	dt->capnext = 2*(dt->nnext + n);
+	if(!(dt->next = realloc(dt->next, sizeof(u32) * dt->capnext)))
+	    DIE("Out of memory for " IFMT " ranks", dt->capnext);
+    }
+    memcpy(dt->next + dt->nnext, buf, sizeof(u32) * n);
+    dt->nnext += n;
+    dt->used += n;
+    pthread_mutex_unlock(&dt->lock);
+}
+
+/** Direct: breadth first, one layer at a time.
+ * Threads split each layer and meet at a barrier before the next.
+ */
+static void *direct_thread(ThreadState *ts)
+{
+    int i, n = 0, j;
+    Solver *ks = ts->ks;
+    Direct *dt = &ks->dt;
+    Iint at, end;
+    u32 r, *buf = safe_malloc(sizeof(u32) * DIRECT_BUF);
+    Cells cs;
+    List adjs; // type StateFull
+    int sizeof_full = sizeof(StateFull) + 2*ks->bd.npcs;
+    StateFull *nfs, *cfs = alloca(sizeof_full);
+
+    numa_pin(ts->i, ks->nthreads);
+    cells_init(ks, &cs);
+    list_init(&adjs, sizeof_full, 4*ks->bd.nsp);
+
+    while(1) {
+	// expand our share of this layer
+	while(!ks->done && (at = __sync_fetch_and_add(&dt->pos, DIRECT_CHUNK)) < dt->ncur) {
+	    end = (at + DIRECT_CHUNK < dt->ncur) ? at + DIRECT_CHUNK : dt->ncur;
+	    for(; at < end; at++) {
+		codec_unrank(&dt->codec, dt->cur[at], cfs->pcs);
+		ts->dpth = dt->depth;
+		state_adj(ks, &adjs, NULL, cfs->pcs, 0, &cs);
+		for(i=0; i < adjs.length; i++) {
+		    ts->num++;
+		    nfs = &listv_el(StateFull, &adjs, i);
+		    r = codec_rank(&dt->codec, nfs->pcs);
+		    if(direct_seen(dt, r)) {
+			ts->dup++;
+			continue;
+		    }
+		    // where did the piece end up after the resort?
+		    j = piece_find(cfs->pcs[nfs->semi.ipcs] + ks->bd.dir[nfs->semi.dir],
+			    nfs->pcs, ks->bd.npcs);
+		    dt->move[r] = j*4 + nfs->semi.dir;
+		    if(nfs->pcs[0] == ks->bd.end)
+			solver_found(ks, r+1);
+		    buf[n++] = r;
+		    if(n == DIRECT_BUF) {
+			direct_flush(dt, buf, n);
+			n = 0;
+		    }
+		}
+	    }
+	}
+	if(n)
+	    direct_flush(dt, buf, n);
+	n = 0;
+	// one thread moves on to the next layer while the rest wait
+	if(pthread_barrier_wait(&dt->bar) == PTHREAD_BARRIER_SERIAL_THREAD) {
+	    u32 *tmp = dt->cur;
+	    Iint cap = dt->capcur;
+	    dt->cur = dt->next;
+	    dt->capcur = dt->capnext;
+	    dt->next = tmp;
+	    dt->capnext = cap;
+	    dt->ncur = dt->nnext;
+	    dt->nnext = 0;
+	    dt->pos = 0;
+	    dt->depth++;
+	    if(!dt->ncur && !ks->done)
+		solver_done(ks); // nothing left
+	    // ks->done can change under us in the next layer, this can't
+	    dt->over = ks->done;
+	}
+	pthread_barrier_wait(&dt->bar);
+	if(dt->over)
+	    break;
+    }
+
+    list_fini(&adjs);
+    free(buf);
+    cells_fini(&cs);
+    return NULL;
+}
+
+/** Append our batch of states to the next layer
+ */
+static void bfs_flush(Layers *ly, StatePtr *buf, int n)
+{
+    pthread_mutex_lock(&ly->lock);
+    if(ly->nnext + n > ly->capnext) {
+	ly->capnext = 2*(ly->nnext + n);
+	if(!(ly->next = realloc(ly->next, sizeof(StatePtr) * ly->capnext)))
+	    DIE("Out of memory for " IFMT " states", ly->capnext);
+    }
+    memcpy(ly->next + ly->nnext, buf, sizeof(StatePtr) * n);
+    ly->nnext += n;
+    pthread_mutex_unlock(&ly->lock);
+}
+
+/** BFS: like direct_thread but the states go in the StateSet.  Everything
+ * in next is one move deeper than cur, so no state is ever found again by a
+ * shorter path and the first solution is a shortest one.
+ */
+static void *bfs_thread(ThreadState *ts)
+{
+    int i, n, np, nb = 0;
+    Solver *ks = ts->ks;
+    Layers *ly = &ks->ly;
+    Iint at, end;
+    StatePtr *buf = safe_malloc(sizeof(StatePtr) * BFS_BUF);
+    Expand ex;
+
+    numa_pin(ts->i, ks->nthreads);
+    state_thread(ks->states, &ts->rs);
+    expand_init(ks, &ex, ks->states->sizeof_full);
+
+    while(1) {
+	// expand our share of this layer
+	while(!ks->done && (at = __sync_fetch_and_add(&ly->pos, BFS_CHUNK)) < ly->ncur) {
+	    end = (at + BFS_CHUNK < ly->ncur) ? at + BFS_CHUNK : ly->ncur;
+	    for(; at < end; at += np) {
+		np = (end - at < SOLVER_POP) ? end - at : SOLVER_POP;
+		n = solver_expand(ks, ts, &ex, ly->cur + at, np);
+		for(i=0; i < n; i++) {
+		    if(ex.rets[i] > 0) {
+			ts->dup++;
+			continue;
+		    }
+		    if(ex.nfsv[i]->pcs[0] == ks->bd.end)
+			solver_found(ks, ex.adjp[i]);
+		    buf[nb++] = ex.adjp[i];
+		    if(nb == BFS_BUF) {
+			bfs_flush(ly, buf, nb);
+			nb = 0;
+		    }
+		}
+	    }
+	}
+	if(nb)
+	    bfs_flush(ly, buf, nb);
+	nb = 0;
+	// one thread moves on to the next layer while the rest wait
+	if(pthread_barrier_wait(&ly->bar) == PTHREAD_BARRIER_SERIAL_THREAD) {
+	    StatePtr *tmp = ly->cur;
+	    Iint cap = ly->capcur;
+	    ly->cur = ly->next;
+	    ly->capcur = ly->capnext;
+	    ly->next = tmp;
+	    ly->capnext = cap;
+	    ly->ncur = ly->nnext;
+	    ly->nnext = 0;
+	    ly->pos = 0;
+	    ly->depth++;
+	    if(!ly->ncur && !ks->done)
+		solver_done(ks); // nothing left
+	    ly->over = ks->done;
+	}
+	pthread_barrier_wait(&ly->bar);
+	if(ly->over)
+	    break;
+    }
+
+    expand_fini(&ex);
+    free(buf);
+    memcpy(ts->hits, numa_hits, sizeof(numa_hits));
+    state_thread(ks->states, NULL);
+    return NULL;
+}
+
+static void layers_init(Solver *ks, Layers *ly)
+{
+    ly->capcur = ly->capnext = 1024;
+    ly->cur = safe_malloc(sizeof(StatePtr) * ly->capcur);
+    ly->next = safe_malloc(sizeof(StatePtr) * ly->capnext);
+    pthread_mutex_init(&ly->lock, NULL);
+    pthread_barrier_init(&ly->bar, NULL, ks->nthreads);
+}
+
+static void layers_fini(Layers *ly)
+{
+    free(ly->cur);
+    free(ly->next);
+    pthread_mutex_destroy(&ly->lock);
+    pthread_barrier_destroy(&ly->bar);
+}
+
+/** Is \a fs what \a fr is looking for?
+ */
+static inline int frontier_goal(Solver *ks, Frontier *fr, StateFull *fs, u64 zh)
+{
+    if(fr->meet)
+	return fs->depth == fr->stop && state_find(fr->meet, &ks->bd, fs, zh);
+    return !fr->stop && fs->pcs[0] == ks->bd.end;
+}
+
+/** Frontier: like bfs_thread, but a successor is only new if it isn't in
+ * the last layer or this one, and the layer before the last is thrown away
+ * when we move on.  Those two are read only while next fills up.
+ */
+static void *frontier_thread(ThreadState *ts)
+{
+    int i, n, d, nb = 0;
+    Solver *ks = ts->ks;
+    Frontier *fr = ts->fr;
+    Layers *ly = &fr->ly;
+    StateSet *prev, *cur, *next;
+    Iint at, end;
+    StatePtr *buf = safe_malloc(sizeof(StatePtr) * BFS_BUF);
+    StateFull *nfs, *cfs;
+    List *adjs;
+    Expand ex;
+
+    numa_pin(ts->i, ks->nthreads);
+    state_thread(&fr->sets[0], &ts->rs); // the three sets are the same shape
+    expand_init(ks, &ex, fr->sets[0].sizeof_full);
+    cfs = ex.cfs;
+    adjs = &ex.adjs[0];
+
+    while(1) {
+	d = ly->depth;
+	prev = &fr->sets[(d+2)%3];
+	cur = &fr->sets[d%3];
+	next = &fr->sets[(d+1)%3];
+	// expand our share of this layer
+	while(!fr->found && (at = __sync_fetch_and_add(&ly->pos, BFS_CHUNK)) < ly->ncur) {
+	    end = (at + BFS_CHUNK < ly->ncur) ? at + BFS_CHUNK : ly->ncur;
+	    for(; at < end; at++) {
+		state_ref(cur, &ks->bd, ly->cur[at], cfs);
+		ts->dpth = d;
+		state_adj(ks, adjs, ex.hashes, cfs->pcs, board_hash(&ks->bd, cfs->pcs), &ex.cells[0]);
+		for(i=0, n=0; i < adjs->length; i++) {
+		    ts->num++;
+		    nfs = &listv_el(StateFull, adjs, i);
+		    if(state_find(prev, &ks->bd, nfs, ex.hashes[i]) ||
+			    state_find(cur, &ks->bd, nfs, ex.hashes[i])) {
+			ts->dup++;
+			continue;
+		    }
+		    memset(&nfs->semi, 0, sizeof(StateSemi)); // no parent so it is stored full
+		    nfs->depth = d+1;
+		    ex.nfsv[n] = nfs;
+		    ex.hashes[n++] = ex.hashes[i];
+		}
+		ts->oops += state_insert_batch(next, &ks->bd, ex.nfsv, ex.hashes, n, ex.adjp, ex.rets);
+		for(i=0; i < n; i++) {
+		    if(ex.rets[i]) {
+			ts->dup++;
+			continue;
+		    }
+		    if(frontier_goal(ks, fr, ex.nfsv[i], ex.hashes[i]) &&
+			    __sync_bool_compare_and_swap(&fr->found, 0, 1))
+			memcpy(fr->end, ex.nfsv[i]->pcs, 2*ks->bd.npcs);
+		    buf[nb++] = ex.adjp[i];
+		    if(nb == BFS_BUF) {
+			bfs_flush(ly, buf, nb);
+			nb = 0;
+		    }
+		}
+	    }
+	}
+	if(nb)
+	    bfs_flush(ly, buf, nb);
+	nb = 0;
+	// one thread moves on to the next layer while the rest wait
+	if(pthread_barrier_wait(&ly->bar) == PTHREAD_BARRIER_SERIAL_THREAD) {
+	    StatePtr *tmp = ly->cur;
+	    Iint cap = ly->capcur, used = 0;
+	    ly->cur = ly->next;
+	    ly->capcur = ly->capnext;
+	    ly->next = tmp;
+	    ly->capnext = cap;
+	    ly->ncur = ly->nnext;
+	    ly->nnext = 0;
+	    ly->pos = 0;
+	    ly->depth++;
+	    fr->total += ly->ncur;
+	    for(i=0; i < 3; i++)
+		used += state_used(&fr->sets[i]);
+	    if(used > fr->peak)
+		fr->peak = used;
+	    ly->over = fr->found || !ly->ncur || ly->depth == fr->stop;
+	    if(!ly->over) // the layer before the last makes room for the next
+		state_clear(&fr->sets[(ly->depth+1)%3]);
+	    else if(fr == ks->fr) { // the search
+		ks->solution = fr->found;
+		solver_done(ks);
+	    }
+	}
+	pthread_barrier_wait(&ly->bar);
+	if(ly->over)
+	    break;
+    }
+
+    expand_fini(&ex);
+    free(buf);
+    memcpy(ts->hits, numa_hits, sizeof(numa_hits));
+    state_thread(&fr->sets[0], NULL);
+    return NULL;
+}
+
+/** Start \a fr off from \a pcs.  It stops at layer \a stop (if not 0) or
+ * when it finds a state of that layer in \a meet (if not NULL)
+ */
+static void frontier_start(Solver *ks, Frontier *fr, u16 *pcs, int stop, StateSet *meet)
+{
+    int i;
+    StatePtr sp;
+    StateFull *fs = alloca(fr->sets[0].sizeof_full);
+
+    for(i=0; i < 3; i++)
+	state_clear(&fr->sets[i]);
+    memset(fs, 0, fr->sets[0].sizeof_full);
+    memcpy(fs->pcs, pcs, 2*ks->bd.npcs);
+    state_insert(&fr->sets[0], &ks->bd, fs, board_hash(&ks->bd, pcs), &sp);
+    fr->ly.cur[0] = sp;
+    fr->ly.ncur = 1;
+    fr->ly.nnext = fr->ly.pos = fr->ly.depth = fr->ly.over = 0;
+    fr->stop = stop;
+    fr->meet = meet;
+    fr->found = 0;
+    fr->total = fr->peak = 1;
+}
+
+/** Run \a fr to the end on ks->nthreads new threads
+ */
+static void frontier_run(Solver *ks, Frontier *fr)
+{
+    int i;
+    ThreadState *ts = calloc(ks->nthreads, sizeof(ThreadState));
+    for(i=0; i < ks->nthreads; i++) {
+	ts[i].i = i;
+	ts[i].ks = ks;
+	ts[i].fr = fr;
+	pthread_create(&ts[i].thread, NULL, (ThreadMain)frontier_thread, &ts[i]);
+    }
+    for(i=0; i < ks->nthreads; i++)
+	pthread_join(ts[i].thread, NULL);
+    free(ts);
+}
+
+/** Append the states after \a a on a shortest path to \a b (\a d moves on)
+ * to \a path.  The state halfway is where a search from \a a that stops at
+ * layer d/2 meets one from \a b that stops at d-d/2.
+ */
+static void frontier_walk(Solver *ks, u16 *a, u16 *b, int d, List *path)
+{
+    Frontier *fwd = &ks->fr[0], *bwd = &ks->fr[1];
+    int h = d/2;
+    u16 *m;
+
+    if(d <= 1) {
+	if(d)
+	    memcpy(listv_push(StateFull, path).pcs, b, 2*ks->bd.npcs);
+	return;
+    }
+    frontier_start(ks, fwd, a, h, NULL);
+    frontier_run(ks, fwd);
+    frontier_start(ks, bwd, b, d-h, &fwd->sets[h%3]);
+    frontier_run(ks, bwd);
+    if(!bwd->found)
+	DIE("Lost the way back between two states %d moves apart", d);
+    m = alloca(2*ks->bd.npcs);
+    memcpy(m, bwd->end, 2*ks->bd.npcs);
+    frontier_walk(ks, a, m, h, path);
+    frontier_walk(ks, m, b, d-h, path);
+}
+
+/** \a chain gets the StateFulls from the end state back to the root
+ */
+static void frontier_chain(Solver *ks, List *chain)
+{
+    int i, d = ks->fr[0].ly.depth;
+    List path; // from the root to the end
+    u16 *end = alloca(2*ks->bd.npcs);
+
+    memcpy(end, ks->fr[0].end, 2*ks->bd.npcs); // fr[0] gets reused
+    list_init(&path, chain->el_size, d+1);
+    memcpy(listv_push(StateFull, &path).pcs, ks->bd.pcs, 2*ks->bd.npcs);
+    frontier_walk(ks, ks->bd.pcs, end, d, &path);
+    for(i=path.length-1; i >= 0; i--)
+	memcpy(&listv_push(StateFull, chain), &listv_el(StateFull, &path, i), chain->el_size);
+    list_fini(&path);
+}
+
+static void frontier_init(Solver *ks, Frontier *fr)
+{
+    int i;
+    for(i=0; i < 3; i++)
+	state_init(&fr->sets[i], 8*(ks->opts.nstates / 8), 8, &ks->bd, 1, 0, NULL,
+		ks->opts.index, -1);
+    fr->end = safe_malloc(2*ks->bd.npcs);
+    layers_init(ks, &fr->ly);
+}
+
+static void frontier_fini(Frontier *fr)
+{
+    int i;
+    for(i=0; i < 3; i++)
+	state_fini(&fr->sets[i]);
+    free(fr->end);
+    layers_fini(&fr->ly);
+}
+
+/** Walk back from rank \a sp-1 to the root.  \a chain gets the StateFulls
+ */
+static void direct_chain(Solver *ks, StatePtr sp, List *chain)
+{
+    Direct *dt = &ks->dt;
+    u32 r = sp - 1, root = codec_rank(&dt->codec, ks->bd.pcs);
+    StateFull *fs;
+    u16 *pcs = alloca(2*ks->bd.npcs);
+    u8 m;
+    while(1) {
+	fs = &listp_push(StateFull, chain);
+	codec_unrank(&dt->codec, r, fs->pcs);
+	if(r == root)
+	    break;
+	m = dt->move[r];
+	memcpy(pcs, fs->pcs, 2*ks->bd.npcs);
+	board_apply_move(&ks->bd, pcs, m >> 2, (m & 3) ^ 2); // undo it
+	r = codec_rank(&dt->codec, pcs);
+    }
+}
+
+static void direct_init(Solver *ks)
+{
+    Direct *dt = &ks->dt;
+    u32 root;
+    codec_init(&dt->codec, &ks->bd);
+    if(!dt->codec.total || dt->codec.total > DIRECT_MAX)
+	DIE("Board too big for -e direct (%llu placements)", dt->codec.total);
+    if(ks->bd.npcs > 64)
+	DIE("Too many pieces for -e direct");
+    printf("Direct: %llu placements, %.1f Mb\n", dt->codec.total,
+	    dt->codec.total * 9.0 / 8 / (1024*1024));
+    dt->seen = calloc(dt->codec.total / 32 + 1, sizeof(u32));
+    dt->move = calloc(dt->codec.total, 1);
+    if(!dt->seen || !dt->move)
+	DIE("Out of memory for -e direct");
+    dt->capcur = dt->capnext = 1024;
+    dt->cur = safe_malloc(sizeof(u32) * dt->capcur);
+    dt->next = safe_malloc(sizeof(u32) * dt->capnext);
+    pthread_mutex_init(&dt->lock, NULL);
+    pthread_barrier_init(&dt->bar, NULL, ks->nthreads);
+    // the first layer is just the root
+    root = codec_rank(&dt->codec, ks->bd.pcs);
+    direct_seen(dt, root);
+    dt->cur[dt->ncur++] = root;
+    dt->used = 1;
+}
+
+static void direct_fini(Solver *ks)
+{
+    Direct *dt = &ks->dt;
+    codec_fini(&dt->codec);
+    free(dt->seen);
+    free(dt->move);
+    free(dt->cur);
+    free(dt->next);
+    pthread_mutex_destroy(&dt->lock);
+    pthread_barrier_destroy(&dt->bar);
+}
+
+/** Path of file \a name \a a.\a b in our directory
+ */
+static char *disk_path(Disk *dk, char *path, char name, int a, int b)
+{
+    snprintf(path, DISK_PATH, "%s/%c%d.%d", dk->dir, name, a, b);
+    return path;
+}
+
+/** Sort run \a recs of thread \a ts out to its own file and keep some of
+ * its keys to split the next layer with
+ */
+static void disk_spill(Solver *ks, ThreadState *ts, u8 *recs, u64 n)
+{
+    Disk *dk = &ks->dk;
+    char path[DISK_PATH];
+    DiskOut out;
+    u64 i, nu;
+
+    disk_sort(recs, n, dk->rsize, dk->ksize);
+    nu = disk_uniq(recs, n, dk->rsize, dk->ksize);
+    ts->dup += n - nu;
+    dout_open(&out, disk_path(dk, path, 'R', ts->i, dk->nruns[ts->i]++), dk->rsize);
+    for(i=0; i < nu; i++)
+	dout_put(&out, recs + i*dk->rsize);
+    dout_close(&out);
+
+    pthread_mutex_lock(&dk->lock);
+    for(i=0; i < nu; i += DISK_SAMPLE) {
+	if(dk->nsamples == dk->capsamples) {
+	    dk->capsamples = 2*dk->capsamples + 1024;
+	    if(!(dk->samples = realloc(dk->samples, dk->capsamples * dk->ksize)))
+		DIE("Out of memory for %llu keys", (unsigned long long)dk->capsamples);
+	}
+	memcpy(dk->samples + dk->nsamples++ * dk->ksize, recs + i*dk->rsize, dk->ksize);
+    }
+    pthread_mutex_unlock(&dk->lock);
+}
+
+/** Open the records of \a path with keys in [lo, hi) (NULL for no bound)
  */
-void solver_solve(Solver *ks, int nthreads)
+static void disk_range(Disk *dk, DiskIn *in, char *path, int rsize, u8 *lo, u8 *hi)
 {
-    int i, last=0;
+    u64 first = disk_lower(path, rsize, dk->ksize, lo);
+    u64 last = hi ? disk_lower(path, rsize, dk->ksize, hi) : disk_count(path, rsize);
+    din_open(in, path, rsize, first, last);
+}
+
+/** Merge our range of keys over all the runs into our part of the next
+ * layer, leaving out anything already in this layer or the last
+ */
+static void disk_merge(Solver *ks, ThreadState *ts)
+{
+    Disk *dk = &ks->dk;
+    int i, k, t = ts->i, n = ks->nthreads, d = dk->depth, nr = 0, no = 0;
+    u8 *lo = t ? dk->split + (t-1)*dk->ksize : NULL;
+    u8 *hi = t < n-1 ? dk->split + t*dk->ksize : NULL;
+    u8 *rec, *old, *last = alloca(dk->ksize);
+    char path[DISK_PATH];
+    DiskIn *rin, *oin;
+    DiskMerge runs, olds;
+    DiskOut states, moves;
+
+    for(i=0; i < n; i++)
+	nr += dk->nruns[i];
+    rin = safe_malloc(sizeof(DiskIn) * (nr+1));
+    oin = safe_malloc(sizeof(DiskIn) * 2*n);
+    for(i=0, nr=0; i < n; i++)
+	for(k=0; k < dk->nruns[i]; k++)
+	    disk_range(dk, &rin[nr++], disk_path(dk, path, 'R', i, k), dk->rsize, lo, hi);
+    for(i=0; i < n; i++) {
+	disk_range(dk, &oin[no++], disk_path(dk, path, 'L', d, i), dk->ksize, lo, hi);
+	if(d)
+	    disk_range(dk, &oin[no++], disk_path(dk, path, 'L', d-1, i), dk->ksize, lo, hi);
+    }
+    dmerge_init(&runs, rin, nr, dk->ksize);
+    dmerge_init(&olds, oin, no, dk->ksize);
+    dout_open(&states, disk_path(dk, path, 'L', d+1, t), dk->ksize);
+    dout_open(&moves, disk_path(dk, path, 'M', d+1, t), 1);
+
+    for(i=0; (rec = dmerge_next(&runs)); i=1) {
+	// the same state from another run
+	if(i && !memcmp(rec, last, dk->ksize)) {
+	    ts->dup++;
+	    continue;
+	}
+	memcpy(last, rec, dk->ksize);
+	// both are sorted, so the old layers only ever move forward
+	while((old = dmerge_peek(&olds)) && memcmp(old, rec, dk->ksize) < 0)
+	    dmerge_next(&olds);
+	if(old && !memcmp(old, rec, dk->ksize)) {
+	    ts->dup++;
+	    continue;
+	}
+	dout_put(&states, rec);
+	dout_put(&moves, rec + dk->ksize);
+    }
+    __sync_fetch_and_add(&dk->nnext, states.n);
+
+    dout_close(&states);
+    dout_close(&moves);
+    dmerge_fini(&runs);
+    dmerge_fini(&olds);
+    free(rin);
+    free(oin);
+}
+
+/** Pick the keys that split the next layer into nthreads parts
+ */
+static void disk_split(Solver *ks)
+{
+    Disk *dk = &ks->dk;
+    int i, n = ks->nthreads;
+    memset(dk->split, 0, (n-1) * dk->ksize); // nothing to split if there are no samples
+    disk_sort(dk->samples, dk->nsamples, dk->ksize, dk->ksize);
+    for(i=1; i < n && dk->nsamples; i++)
+	memcpy(dk->split + (i-1)*dk->ksize, dk->samples + (i*dk->nsamples/n) * dk->ksize, dk->ksize);
+    dk->nsamples = 0;
+}
+
+/** Disk: like direct_thread, but this layer is read from our part's file
+ * and the next one is sorted out to runs.  Once every thread is done the
+ * runs are merged (see disk_merge), then they go away.
+ */
+static void *disk_thread(ThreadState *ts)
+{
+    int i, j, k, d;
+    Solver *ks = ts->ks;
+    Disk *dk = &ks->dk;
+    u8 *rec, *run;
+    Cells cs;
+    u64 nr = 0;
+    char path[DISK_PATH];
+    DiskIn in;
+    List adjs; // type StateFull
+    int sizeof_full = sizeof(StateFull) + 2*ks->bd.npcs;
+    StateFull *nfs, *cfs = alloca(sizeof_full);
+
+    numa_pin(ts->i, ks->nthreads);
+    if(!(run = malloc(dk->nrun * dk->rsize)))
+	DIE("Out of memory for a run of %llu states", (unsigned long long)dk->nrun);
+    cells_init(ks, &cs);
+    list_init(&adjs, sizeof_full, 4*ks->bd.nsp);
+
+    while(1) {
+	d = dk->depth;
+	// expand our part of this layer
+	disk_path(dk, path, 'L', d, ts->i);
+	din_open(&in, path, dk->ksize, 0, disk_count(path, dk->ksize));
+	while(!ks->done && (rec = din_next(&in))) {
+	    codec_unpack(&dk->codec, rec, cfs->pcs);
+	    ts->dpth = d;
+	    state_adj(ks, &adjs, NULL, cfs->pcs, 0, &cs);
+	    for(i=0; i < adjs.length; i++) {
+		ts->num++;
+		nfs = &listv_el(StateFull, &adjs, i);
+		// where did the piece end up after the resort?
+		j = piece_find(cfs->pcs[nfs->semi.ipcs] + ks->bd.dir[nfs->semi.dir],
+			nfs->pcs, ks->bd.npcs);
+		if(nfs->pcs[0] == ks->bd.end && __sync_bool_compare_and_swap(&dk->found, 0, 1)) {
+		    memcpy(dk->end, nfs->pcs, 2*ks->bd.npcs);
+		    dk->endmove = j*4 + nfs->semi.dir;
+		    solver_found(ks, 1);
+		}
+		codec_pack(&dk->codec, nfs->pcs, run + nr*dk->rsize);
+		run[nr*dk->rsize + dk->ksize] = j*4 + nfs->semi.dir;
+		if(++nr == dk->nrun) {
+		    disk_spill(ks, ts, run, nr);
+		    nr = 0;
+		}
+	    }
+	}
+	din_close(&in);
+	if(nr && !ks->done)
+	    disk_spill(ks, ts, run, nr);
+	nr = 0;
+	// one thread splits up the next layer while the rest wait
+	if(pthread_barrier_wait(&dk->bar) == PTHREAD_BARRIER_SERIAL_THREAD) {
+	    if((dk->over = ks->done))
+		dk->depth++; // where the end is
+	    else
+		disk_split(ks);
+	}
+	pthread_barrier_wait(&dk->bar);
+	if(dk->over)
+	    break;
+	disk_merge(ks, ts);
+	// and moves on to it
+	if(pthread_barrier_wait(&dk->bar) == PTHREAD_BARRIER_SERIAL_THREAD) {
+	    for(i=0; i < ks->nthreads; i++) {
+		for(k=0; k < dk->nruns[i]; k++)
+		    unlink(disk_path(dk, path, 'R', i, k));
+		dk->nruns[i] = 0;
+	    }
+	    dk->ncur = dk->nnext;
+	    dk->nnext = 0;
+	    dk->used += dk->ncur;
+	    dk->depth++;
+	    if(!dk->ncur && !ks->done)
+		solver_done(ks); // nothing left
+	    dk->over = ks->done;
+	}
+	pthread_barrier_wait(&dk->bar);
+	if(dk->over)
+	    break;
+    }
+
+    list_fini(&adjs);
+    free(run);
+    cells_fini(&cs);
+    return NULL;
+}
+
+/** The move that made \a pcs, which is in layer \a d
+ */
+static u8 disk_move(Solver *ks, int d, u16 *pcs)
+{
+    Disk *dk = &ks->dk;
+    int t;
+    u64 i;
+    u8 m, *key = alloca(dk->ksize), *rec = alloca(dk->ksize);
+    char path[DISK_PATH];
+
+    codec_pack(&dk->codec, pcs, key);
+    for(t=0; t < ks->nthreads; t++) {
+	disk_path(dk, path, 'L', d, t);
+	i = disk_lower(path, dk->ksize, dk->ksize, key);
+	if(i == disk_count(path, dk->ksize))
+	    continue;
+	disk_read(path, dk->ksize, i, rec);
+	if(memcmp(rec, key, dk->ksize))
+	    continue;
+	disk_read(disk_path(dk, path, 'M', d, t), 1, i, &m);
+	return m;
+    }
+    DIE("Lost the way back at depth %d", d);
+    return 0;
+}
+
+/** Walk back from the end to the root.  \a chain gets the StateFulls
+ */
+static void disk_chain(Solver *ks, List *chain)
+{
+    Disk *dk = &ks->dk;
+    int d = dk->depth;
+    u8 m = dk->endmove;
+    u16 *pcs = alloca(2*ks->bd.npcs);
+
+    memcpy(pcs, dk->end, 2*ks->bd.npcs);
+    while(1) {
+	memcpy(listp_push(StateFull, chain).pcs, pcs, 2*ks->bd.npcs);
+	if(!d--)
+	    break;
+	board_apply_move(&ks->bd, pcs, m >> 2, (m & 3) ^ 2); // undo it
+	if(d)
+	    m = disk_move(ks, d, pcs);
+    }
+}
+
+static void disk_init(Solver *ks)
+{
+    Disk *dk = &ks->dk;
+    int i, n = ks->nthreads;
+    char *dir = ks->opts.dir ? ks->opts.dir : getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[DISK_PATH];
+    DiskOut out;
+    u8 move = 0;
+
+    snprintf(dk->dir, sizeof(dk->dir), "%s/klot-XXXXXX", dir);
+    if(!mkdtemp(dk->dir))
+	DIE("Can't make a directory in %s", dir);
+    codec_init(&dk->codec, &ks->bd);
+    dk->ksize = dk->codec.nbytes;
+    dk->rsize = dk->ksize + 1;
+    dk->nrun = ks->opts.nstates / n;
+    if(dk->nrun < 1024)
+	dk->nrun = 1024;
+    printf("Disk: %s, %d byte states, runs of %llu\n", dk->dir, dk->ksize,
+	    (unsigned long long)dk->nrun);
+    dk->nruns = calloc(n, sizeof(int));
+    dk->split = safe_malloc(n * dk->ksize);
+    dk->end = safe_malloc(2*ks->bd.npcs);
+    pthread_mutex_init(&dk->lock, NULL);
+    pthread_barrier_init(&dk->bar, NULL, n);
+    // the first layer is just the root (in part 0)
+    for(i=0; i < n; i++) {
+	dout_open(&out, disk_path(dk, path, 'L', 0, i), dk->ksize);
+	if(!i) {
+	    u8 *key = alloca(dk->ksize);
+	    codec_pack(&dk->codec, ks->bd.pcs, key);
+	    dout_put(&out, key);
+	}
+	dout_close(&out);
+	dout_open(&out, disk_path(dk, path, 'M', 0, i), 1);
+	if(!i)
+	    dout_put(&out, &move);
+	dout_close(&out);
+    }
+    dk->ncur = dk->used = 1;
+}
+
+static void disk_fini(Solver *ks)
+{
+    Disk *dk = &ks->dk;
+    char path[DISK_PATH];
+    struct dirent *de;
+    DIR *dir;
+
+    // all the layers (and any runs left when we found the end)
+    if((dir = opendir(dk->dir))) {
+	while((de = readdir(dir)))
+	    if(de->d_name[0] != '.') {
+		snprintf(path, DISK_PATH, "%s/%s", dk->dir, de->d_name);
+		unlink(path);
+	    }
+	closedir(dir);
+    }
+    rmdir(dk->dir);
+    codec_fini(&dk->codec);
+    free(dk->nruns);
+    free(dk->samples);
+    free(dk->split);
+    free(dk->end);
+    pthread_mutex_destroy(&dk->lock);
+    pthread_barrier_destroy(&dk->bar);
+}
+
+/** Insert the starting state into \a ss (or note which node has it)
+ */
+static void solver_add_root(Solver *ks, StateSet *ss)
+{
+    StateFull *fs = alloca(ss->sizeof_full);
+    memset(fs, 0, ss->sizeof_full);
+    memcpy(fs->pcs, ks->bd.pcs, 2*ks->bd.npcs);
+    fs->semi.node = ss->node;
+    ks->rootnode = ss->node;
+    u64 zh = board_hash(&ks->bd, fs->pcs);
+    if(state_insert(ss, &ks->bd, fs, zh, &ks->root) == 2) {
+	ks->rootnode = ks->root;
+	ks->root = 0;
+	if(ss->peers) // we can put it there ourselves
+	    state_insert(&ss->peers[ks->rootnode], &ks->bd, fs, zh, &ks->root);
+    }
+}
+
+/** Fork off the other nodes and set up our own partition
+ */
+static void node_start(Solver *ks)
+{
+    int node;
+    ks->ctlmem.work = ks->nparts; // every node starts out busy
+    ks->net = safe_malloc(sizeof(Net));
+    ks->ctl = net_init(ks->net, ks->nparts, ks->rsize, &ks->ctlmem, sizeof(HdaCtl));
+    node = ks->net->node;
+    state_init(&ks->states[node], 8*(ks->opts.nstates / ks->nparts / 8), 8,
+	    &ks->bd, ks->nparts, node, NULL, ks->opts.index,
+	    numa_nodes ? numa_home(node, ks->nparts) : -1);
+    solver_add_root(ks, &ks->states[node]);
+}
+
+/** The search is over.  Hand node 0 whatever states it asks for until it
+ * tells us to quit.
+ */
+static void node_serve(Solver *ks)
+{
+    Net *net = ks->net;
+    NetHdr *h;
+    char *rec = alloca(ks->rsize);
+    while(1) {
+	net_poll(net, 100);
+	while((h = net_next(net))) {
+	    if(h->type == NET_QUIT)
+		return;
+	    if(h->type == NET_REF) {
+		state_ref(&ks->states[net->node], &ks->bd, h->arg, REC_STATE(rec));
+		net_send(net, h->from, NET_STATE, 0, rec, 1);
+	    }
+	}
+    }
+}
+
+/** Get state \a sp of partition \a node, wherever it lives
+ */
+static void solver_fetch(Solver *ks, int node, StatePtr sp, StateFull *fs)
+{
+    Net *net = ks->net;
+    NetHdr *h;
+    if(!net || node == net->node) {
+	state_ref(&ks->states[node], &ks->bd, sp, fs);
+	return;
+    }
+    net_send(net, node, NET_REF, sp, NULL, 0);
+    while(1) {
+	net_poll(net, 100);
+	while((h = net_next(net))) {
+	    if(h->type == NET_STATE && h->from == node) {
+		memcpy(fs, REC_STATE(h+1), ks->states->sizeof_full);
+		return;
+	    }
+	}
+    }
+}
+
+/** Solves the puzzle using ks->nthreads
+ * With several nodes every process comes through here with one thread.
+ * Only node 0 returns.
+ */
+void solver_solve(Solver *ks)
+{
+    int i, nthreads = ks->nthreads, hda = (ks->engine == ENGINE_HDA);
+    Iint last = 0;
+    RefStats rs, lastrs = {0};
+    int direct = (ks->engine == ENGINE_DIRECT), bfs = (ks->engine == ENGINE_BFS);
+    int fsearch = (ks->engine == ENGINE_FRONTIER), dsearch = (ks->engine == ENGINE_DISK);
+    int local = hda || (ks->engine == ENGINE_ASTAR && ks->opts.queue != QUEUE_MULTI); // a queue per thread?
+    volatile int *done = &ks->done;
     ThreadState *threads;
-    threads = safe_malloc(sizeof(ThreadState) * nthreads);
-    ks->active_threads = nthreads;
+
+    if(ks->opts.nnodes > 1) {
+	node_start(ks);
+	nthreads = 1;
+    }
+    int node = ks->net ? ks->net->node : 0;
+    threads = ks->threads = calloc(nthreads, sizeof(ThreadState));
+    if(!ks->net) {
+	ks->ctl = &ks->ctlmem;
+	ks->ctl->work = nthreads;
+    }
+    if(hda)
+	done = &ks->ctl->done;
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+    // Set up the frontiers (and partitions)
+    Iint qsize = local ? QFANOUT*((Iint)(ks->opts.nstates / ks->nparts * 0.5) / QFANOUT) : 0;
+    for(i=0; local && i < nthreads; i++) {
+	if(ks->opts.queue == QUEUE_BUCKET)
+	    queue_init_bucket(&threads[i].pq);
+	else
+	    queue_init(&threads[i].pq, qsize);
+	if(hda) {
+	    threads[i].out = calloc(ks->nparts, sizeof(MBatch*));
+	    if(node + i == ks->rootnode && ks->root)
+		queue_push(&threads[i].pq, ks->root, 0);
+	}
+    }
+    if(bfs) // the first layer is just the root
+	ks->ly.cur[ks->ly.ncur++] = ks->root;
+    else if(ks->engine == ENGINE_ASTAR)
+	queue_push(frontier(ks, 0), ks->root, 0);
+
     // Start the threads
     for(i=0; i < nthreads; i++) {
-	threads[i].i = i;
+	threads[i].i = node + i;
 	threads[i].ks = ks;
 	threads[i].num = threads[i].dup = threads[i].oops = 0;
+	threads[i].fr = ks->fr;
 	pthread_mutex_init(&threads[i].lock, NULL);
-	pthread_create(&threads[i].thread, &attr, (ThreadMain)solver_thread, (void*)&threads[i]);
+	pthread_create(&threads[i].thread, &attr,
+		(ThreadMain)(hda ? hda_thread : direct ? direct_thread : bfs ? bfs_thread :
+		    fsearch ? frontier_thread : dsearch ? disk_thread : solver_thread),
+		(void*)&threads[i]);
     }
     pthread_attr_destroy(&attr);
-    printf("depth: states examined / unique states (states, index, queue)\n");
+    if(!node)
+	printf("depth: states examined / unique states (states, index, queue)\n");
     // wait for the end and print stats
     while(1) {
-	pthread_mutex_lock(&ks->alock);
-	i = ks->active_threads;
-	pthread_mutex_unlock(&ks->alock);
-	if(!i || ks->solution) // game is over
+	futex_wait(done, 0, 100); // dont print stats too fast
+	if(*done) // game is over
 	    break;
-	// still going
-	int num = 0, used = state_used(&ks->states);
+	// still going (with several nodes these are node 0's numbers)
+	Iint num = 0, used = solver_used(ks), idx = 0, queued = ks->pq.num;
 	for(i=0; i < nthreads; i++)
 	    num += threads[i].num;
+	for(i=0; i < ks->nparts; i++)
+	    idx += index_used(&ks->states[i].idx);
+	if(local)
+	    for(i=0, queued=0; i < nthreads; i++)
+		queued += threads[i].pq.num;
+	if(direct)
+	    queued = ks->dt.ncur;
+	if(bfs)
+	    queued = ks->ly.ncur;
+	if(fsearch)
+	    queued = ks->fr->ly.ncur;
+	if(dsearch)
+	    queued = ks->dk.ncur;
+
+	// store more or fewer full states depending on what replay costs
+	memset(&rs, 0, sizeof(rs));
+	for(i=0; i < nthreads; i++) {
+	    rs.refs += threads[i].rs.refs;
+	    rs.steps += threads[i].rs.steps;
+	}
+	if(rs.refs - lastrs.refs > 1000) {
+	    lastrs.refs = rs.refs - lastrs.refs;
+	    lastrs.steps = rs.steps - lastrs.steps;
+	    for(i=0; i < ks->nparts; i++)
+		state_tune(&ks->states[i], &lastrs);
+	    lastrs = rs;
+	}
 	
-	printf(" %3d / %0.2f : %0.2f / %0.2f (%.1f, %.1f, %.1f) rate:%0.2f \r",
-		threads[0].dpth, threads[0].dist, num/1.0e6, used/1.0e6,
-		100.0*used / num,
-		100.0*ks->states.idx.nodes.used*FANOUT / num,
-		100.0*ks->pq.num / num,	(num-last)*10.0 / 1000.0
-		);
+	if(!node)
+	    printf(" %3d / %0.2f : %0.2f / %0.2f (%.1f, %.1f, %.1f) rate:%0.2f \r",
+		    threads[0].dpth, threads[0].dist, num/1.0e6, used/1.0e6,
+		    100.0*used / num,
+		    100.0*idx / num,
+		    100.0*queued / num,	(num-last)*10.0 / 1000.0
+		    );
 	last = num;
 	fflush(stdout);
-	usleep(100000); // dont print stats too fast
     }
-    printf("\n");
+    if(!node)
+	printf("\n");
 
     // join back with all the threads
+    Iint hits[2] = {0, 0};
+    memset(&rs, 0, sizeof(rs));
     for(i=0; i < nthreads; i++) {
 	void *ret;
 	pthread_join(threads[i].thread, &ret);
 	pthread_mutex_destroy(&threads[i].lock);
+	if(local)
+	    queue_fini(&threads[i].pq);
+	free(threads[i].out);
+	hits[0] += threads[i].hits[0];
+	hits[1] += threads[i].hits[1];
+	rs.refs += threads[i].rs.refs;
+	rs.looks += threads[i].rs.looks;
+	rs.hits += threads[i].rs.hits;
+	rs.steps += threads[i].rs.steps;
+	rs.chained += threads[i].rs.chained;
+	rs.skipped += threads[i].rs.skipped;
     }
-
+    if(!node && rs.chained)
+	printf("index chains: " IFMT " of " IFMT " semi states passed over on their fingerprint\n",
+		rs.skipped, rs.chained);
+    if(!node && rs.refs)
+	printf("state_ref: %.1f%% cache hits, %.2f moves replayed per ref, 1 in %d new states full\n",
+		100.0 * rs.hits / (rs.looks ?: 1), rs.steps / (float)rs.refs, ks->states[0].fdiv);
+    for(i=0, last=0; i < ks->nparts; i++)
+	last += ks->states[i].shorterr;
+    if(!node && last)
+	printf("Depths: " IFMT " states were reached again by a shorter path\n", last);
+    if(fsearch)
+	printf("Frontier: kept at most " IFMT " of " IFMT " states\n", ks->fr->peak, ks->fr->total);
+    if(!node && hits[0] + hits[1])
+	printf("NUMA: %.1f%% of index lookups went to another home\n",
+		100.0 * hits[1] / (hits[0] + hits[1]));
+    // throw away anything still in flight
+    for(i=0; ks->mbox && i < ks->nparts; i++)
+	mbox_fini(&ks->mbox[i]);
     free(threads);
+    ks->threads = NULL;
+
+    if(hda) {
+	ks->solution = ks->ctl->solution;
+	ks->solnode = ks->ctl->solnode;
+    }
+    if(ks->net) {
+	__sync_fetch_and_add(&ks->ctl->used, state_used(&ks->states[node]));
+	__sync_fetch_and_add(&ks->ctl->reported, 1);
+	while(!node && ks->ctl->reported < ks->nparts)
+	    net_poll(ks->net, 10);
+    }
+    if(node) {
+	node_serve(ks);
+	exit(0);
+    }
 }
 
 /**
@@ -299,61 +1831,148 @@ Move state_diff_move(Board *bd, u16 *p1, u16 *p2, u16 *perm)
 }
 
 
-static void _sol_seq(Solver *ks, u16 *perm, StatePtr sp, StatePtr psp, List *seq)
+/**
+ * Pass a state (and its partition) to backtrace and an empty initilized List of type Move
+ */
+void solver_make_sequence(Solver *ks, int node, StatePtr sp, List *seq)
 {
-    if(!sp) {
-	// init to straight permutation
-	int i;
-	for(i=0; i < ks->bd.npcs ; i++)
-	    perm[i] = i;
-    } else {
-	StateFull *fs = alloca(ks->states.sizeof_full);
-	StateFull *ps = alloca(ks->states.sizeof_full);
-	state_ref(&ks->states, &ks->bd, sp, fs);
-	state_ref(&ks->states, &ks->bd, psp, ps);
-	_sol_seq(ks, perm, fs->semi.parent, sp, seq);
-	listp_push(Move, seq) = state_diff_move(&ks->bd, fs->pcs, ps->pcs, perm);
+    int i, flip;
+    StateFull *fs;
+    List chain; // type:StateFull from sp back to the root
+    u16 *perm = alloca(2*ks->bd.npcs);
+
+    list_init(&chain, sizeof(StateFull) + 2*ks->bd.npcs, 16);
+    if(ks->engine == ENGINE_DIRECT)
+	direct_chain(ks, sp, &chain);
+    else if(ks->engine == ENGINE_FRONTIER)
+	frontier_chain(ks, &chain);
+    else if(ks->engine == ENGINE_DISK)
+	disk_chain(ks, &chain);
+    else while(sp) {
+	fs = &listv_push(StateFull, &chain);
+	solver_fetch(ks, node, sp, fs);
+	node = fs->semi.node;
+	sp = fs->semi.parent;
     }
+    // the states were stored either way round.  Flip them back so each one
+    // is a move from the one before
+    for(i=chain.length-1, flip=0; ks->mirror && i >= 0; i--) {
+	fs = &listv_el(StateFull, &chain, i);
+	if((flip ^= fs->semi.mirror))
+	    board_mirror(&ks->bd, fs->pcs);
+    }
+    // init to straight permutation
+    for(i=0; i < ks->bd.npcs ; i++)
+	perm[i] = i;
+    for(i=chain.length-1; i > 0; i--)
+	listp_push(Move, seq) = state_diff_move(&ks->bd,
+		listv_el(StateFull, &chain, i).pcs, listv_el(StateFull, &chain, i-1).pcs, perm);
+    list_fini(&chain);
 }
 
-/**
- * Pass a state to backtrace and an empty initilized List of type Move
+/** Number of states stored over all partitions
  */
-void solver_make_sequence(Solver *ks, StatePtr sp, List *seq)
+Iint solver_used(Solver *ks)
 {
-    StateFull *fs = alloca(ks->states.sizeof_full);
-    u16 *perm = alloca(2*ks->bd.npcs);
-    state_ref(&ks->states, &ks->bd, sp, fs);
-    _sol_seq(ks, perm, fs->semi.parent, sp, seq);
+    int i;
+    Iint used = 0;
+    if(ks->engine == ENGINE_DIRECT)
+	return ks->dt.used;
+    if(ks->engine == ENGINE_FRONTIER)
+	return ks->fr->total;
+    if(ks->engine == ENGINE_DISK)
+	return ks->dk.used;
+    if(ks->net && ks->ctl->reported == ks->nparts)
+	return ks->ctl->used; // every node has added theirs
+    for(i=0; i < ks->nparts; i++)
+	used += state_used(&ks->states[i]);
+    return used;
 }
 
-void solver_init(Solver *ks, Board bd, Iint nstates)
+void solver_init(Solver *ks, Board bd, SolverOpts *opts)
 {
+    int i;
     memset(ks, 0, sizeof(Solver));
 
     // set up data structures
     ks->bd = bd;
-    // init states
-    state_init(&ks->states, nstates, 8, bd.npcs, 1);
-    // init priority queue
-    queue_init(&ks->pq, QFANOUT*(nstates*0.5/QFANOUT));
-    pthread_mutex_init(&ks->alock, NULL);
+    ks->opts = *opts;
+    ks->engine = opts->nnodes > 1 ? ENGINE_HDA : opts->engine;
+    // the engines without a StateSet walk back by undoing moves
+    ks->mirror = bd.sym && !opts->nosym && (ks->engine == ENGINE_ASTAR ||
+	    ks->engine == ENGINE_HDA || ks->engine == ENGINE_BFS);
+    ks->nthreads = opts->nthreads;
+    // init states. HDA* splits them into a partition per thread (or node)
+    ks->nparts = 1;
+    if(opts->nnodes > 1)
+	ks->nparts = opts->nnodes;
+    else if(ks->engine == ENGINE_HDA)
+	ks->nparts = ks->nthreads;
+    else if(ks->engine == ENGINE_DIRECT || ks->engine == ENGINE_FRONTIER || ks->engine == ENGINE_DISK)
+	ks->nparts = 0; // no StateSet at all (frontier has its own)
+    ks->states = calloc(ks->nparts, sizeof(StateSet));
+    ks->rsize = (sizeof(u64) + sizeof(float) + sizeof(StateFull) + 2*bd.npcs + 7) & ~7;
+    if(opts->nnodes > 1) {
+	// every node sets up its own partition when it starts
+	ks->states->sizeof_full = sizeof(StateFull) + 2*bd.npcs;
+    } else {
+	// HDA* partitions live with their threads, a shared set is spread out
+	for(i=0; i < ks->nparts; i++)
+	    state_init(&ks->states[i], 8*(opts->nstates / ks->nparts / 8), 8, &ks->bd,
+		    ks->nparts, i, ks->nparts > 1 ? ks->states : NULL, opts->index,
+		    (numa_nodes && ks->nparts > 1) ? numa_home(i, ks->nparts) : -1);
+    }
+    if(ks->engine == ENGINE_HDA) {
+	ks->mbox = safe_malloc(sizeof(Mbox) * ks->nparts);
+	for(i=0; i < ks->nparts; i++)
+	    mbox_init(&ks->mbox[i]);
+    } else if(ks->engine == ENGINE_DIRECT) {
+	direct_init(ks);
+    } else if(ks->engine == ENGINE_BFS) {
+	layers_init(ks, &ks->ly);
+    } else if(ks->engine == ENGINE_FRONTIER) {
+	frontier_init(ks, &ks->fr[0]);
+	frontier_init(ks, &ks->fr[1]);
+	frontier_start(ks, ks->fr, ks->bd.pcs, 0, NULL);
+    } else if(ks->engine == ENGINE_DISK) {
+	disk_init(ks);
+    } else if(opts->queue == QUEUE_MULTI) {
+	// one shared MultiQueue, otherwise every thread gets a frontier
+	queue_init_multi(&ks->pq, QFANOUT*(opts->nstates*0.5/QFANOUT), QMULTI_C*ks->nthreads);
+    }
 
     // add the initial state
-    StateFull *fs = alloca(ks->states.sizeof_full);
-    memset(fs, 0, ks->states.sizeof_full);
-    memcpy(fs->pcs, bd.pcs, 2*bd.npcs);
-    state_insert(&ks->states, &ks->bd, fs, &ks->root);
     ks->solution = 0;
-    queue_push(&ks->pq, ks->root, 0);
+    if(opts->nnodes <= 1 && ks->nparts)
+	solver_add_root(ks, ks->states);
 }
 
 void solver_fini(Solver *ks)
 {
+    int i;
     // sv->bd is freed by parent
-    state_fini(&ks->states);
-    queue_fini(&ks->pq);
-    pthread_mutex_destroy(&ks->alock);
+    if(ks->net) {
+	net_fini(ks->net);
+	state_fini(&ks->states[ks->net->node]);
+	free(ks->net);
+    } else {
+	for(i=0; i < ks->nparts; i++)
+	    state_fini(&ks->states[i]);
+    }
+    free(ks->states);
+    if(ks->engine == ENGINE_HDA)
+	free(ks->mbox);
+    else if(ks->engine == ENGINE_DIRECT)
+	direct_fini(ks);
+    else if(ks->engine == ENGINE_BFS)
+	layers_fini(&ks->ly);
+    else if(ks->engine == ENGINE_FRONTIER) {
+	frontier_fini(&ks->fr[0]);
+	frontier_fini(&ks->fr[1]);
+    } else if(ks->engine == ENGINE_DISK)
+	disk_fini(ks);
+    else if(ks->opts.queue == QUEUE_MULTI)
+	queue_fini(&ks->pq);
 }
 
 #undef TYPE
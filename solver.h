@@ -18,37 +18,193 @@ rbtree (index pk:hash)  N
 #include "queue.h"
 #include "board.h"
 #include "state.h"
+#include "mbox.h"
+#include "net.h"
+#include "numa.h"
+#include "disk.h"
+
+#define ENGINE_ASTAR 0  // all threads share one queue and one StateSet
+#define ENGINE_HDA   1  // every thread owns a hash partition (HDA*)
+#define ENGINE_DIRECT 2 // layered BFS over a perfect rank (small boards)
+#define ENGINE_BFS   3  // layered BFS over the StateSet (shortest solutions)
+#define ENGINE_FRONTIER 4 // layered BFS that only keeps the last three layers
+#define ENGINE_DISK  5  // layered BFS with the layers on disk
+
+#define DIRECT_MAX (1ULL<<31) // most ranks ENGINE_DIRECT takes on
+#define DIRECT_CHUNK 64       // ranks a thread claims at a time
+#define DIRECT_BUF 1024       // ranks a thread finds before adding them to next
+#define SOLVER_POP 4          // states expanded before their successors go in (one batch)
+#define BFS_CHUNK 64          // states a thread claims from a layer at a time
+#define BFS_BUF 1024          // new states a thread finds before adding them to next
+#define DISK_SAMPLE 1024      // run records per key sampled for the splitters
+#define DISK_PATH 512         // room for a file name under Disk.dir
 
 typedef struct {
     u16 piece;
     u16 dir;
 } Move;
 
+/** Knobs picked on the command line
+ */
+typedef struct {
+    int engine;    // ENGINE_*
+    int index;     // INDEX_BTREE or INDEX_HASH
+    int nthreads;  // number of solver threads
+    int nnodes;    // number of processes (HDA* with one thread per node)
+    Iint nstates;  // states to make room for (over all nodes)
+    int queue;     // QUEUE_HEAP, QUEUE_MULTI (astar) or QUEUE_BUCKET
+    char *dir;     // where ENGINE_DISK puts its files (NULL for $TMPDIR)
+    int nosym;     // keep a state and its mirror image apart
+} SolverOpts;
+
+/** HDA* bookkeeping.  Shared memory when the partitions are processes
+ */
+typedef struct {
+    int work;             // busy partitions + batches in flight. Zero means done
+    volatile int done;    // everyone stop
+    int found;            // someone claimed the solution
+    StatePtr solution;    // the end state
+    int solnode;          // partition of the end state
+    Iint used;            // states stored, summed as the nodes finish
+    int reported;         // nodes that have added to used
+} HdaCtl;
+
+/** ENGINE_DIRECT: every placement of the pieces has a rank so states need
+ * no index and no StateSet
+ */
+typedef struct {
+    Codec codec;          // the perfect rank
+    u32 *seen;            // bitmap of ranks seen
+    u8 *move;             // piece (index in the child) * 4 + dir that reached a rank
+    u32 *cur, *next;      // ranks in this layer and the next one
+    Iint ncur, nnext;     // ranks used
+    Iint capcur, capnext; // ranks allocated
+    Iint pos;             // next unclaimed entry of cur
+    Iint used;            // ranks seen
+    int depth;            // of the current layer
+    int over;             // set between layers when we are done
+    pthread_mutex_t lock; // for growing next
+    pthread_barrier_t bar; // between layers
+} Direct;
+
+/** ENGINE_BFS: the frontier is kept a layer at a time, so every state goes
+ * in at its shortest depth and the first solution found is a shortest one
+ */
+typedef struct {
+    StatePtr *cur, *next; // states in this layer and the next one
+    Iint ncur, nnext;     // states used
+    Iint capcur, capnext; // states allocated
+    Iint pos;             // next unclaimed entry of cur
+    int depth;            // of the current layer
+    int over;             // set between layers when we are done
+    pthread_mutex_t lock; // for growing next
+    pthread_barrier_t bar; // between layers
+} Layers;
+
+/** ENGINE_FRONTIER: layered BFS that only keeps the layers a duplicate can
+ * be in.  Moves are reversible, so a successor of layer d is in layer d-1, d
+ * or d+1 and everything older can go.  With the old layers gone there are no
+ * parents to follow back; the path is rebuilt by searching again for the
+ * state halfway along it (see frontier_walk).
+ */
+typedef struct {
+    StateSet sets[3];     // layer d lives in sets[d%3]
+    Layers ly;            // cur and next point into their sets
+    int stop;             // depth to stop at (0 to go until the main piece is home)
+    StateSet *meet;       // stop on a state of layer stop that is in here
+    int found;            // set by whoever found it
+    u16 *end;             // and the pcs of what they found
+    Iint total, peak;     // states seen, most states kept at once
+} Frontier;
+
+/** ENGINE_DISK: breadth first with the layers in files.  Every thread sorts
+ * the successors it makes into runs of nrun.  The runs are merged against
+ * the last two layers, which is the only place their duplicates can be
+ * (moves are reversible), and each thread merges its own range of keys so
+ * a layer is nthreads files in key order.  The move that made each state
+ * goes in a side file, which is all it takes to walk back from the end.
+ */
+typedef struct {
+    char dir[256];        // our directory, files are L<depth>.<part>, M.. and R<thread>.<run>
+    Codec codec;          // states are codec_packed
+    int ksize, rsize;     // bytes in a state, in a run record (the state and its move)
+    u64 nrun;             // records in a run
+    int *nruns;           // runs each thread wrote this layer
+    u8 *samples;          // keys sampled from the runs
+    u64 nsamples, capsamples;
+    u8 *split;            // nthreads-1 keys that split up the next layer
+    u64 ncur, nnext;      // states in this layer and the next one
+    u64 used;             // states in all the layers
+    int depth;            // of the current layer
+    int over;             // set between layers when we are done
+    int found;            // someone found the end
+    u16 *end;             // its pcs
+    u8 endmove;           // and the move that made it
+    pthread_mutex_t lock; // for samples
+    pthread_barrier_t bar; // between the sort and merge of every layer
+} Disk;
+
 typedef struct {
     pthread_t thread;
     int i; // thread number
-    int num, oops, dup, dpth; //number of states analyzed
+    Iint num, dup; //number of states analyzed
+    int oops, dpth;
     float dist;
+    Iint hits[2]; // index lookups on our NUMA home, on another one
+    RefStats rs;  // what our state_refs cost
     pthread_mutex_t lock; // for communicating with parent
     Solver *ks;  // the shared solver state
+    Queue pq;    // our frontier (of our partition for HDA*)
+    // HDA* only
+    MBatch **out; // batch being filled for each partition
+    // frontier only
+    Frontier *fr; // the search we are helping with
 } ThreadState;
 
 struct s_Solver {
-    int active_threads;   // number of threads processing states
-    pthread_mutex_t alock; // small lock for atomic operations.
+    int engine;           // ENGINE_*
+    int nthreads;         // number of solver threads
+    ThreadState *threads; // the solver threads while solving
+    int idle;             // threads out of work and not looking for any
+    int sleepers;         // threads in solver_steal
+    volatile int wake;    // futex. bumped when there is work to steal
+    volatile int done;    // futex. the search is over
     int early_abort;      // everyone stop and exit
     Board bd;             // the starting board
     StatePtr root;        // starting state
+    int rootnode;         // partition of the starting state
     StatePtr solution;    // the end state
-    Queue pq;             // priority queue
-    StateSet states;      // the states living on this node
+    int solnode;          // partition of the end state
+    Queue pq;             // shared frontier (QUEUE_MULTI only)
+    int nparts;           // number of partitions (nthreads for HDA*, else 1)
+    StateSet *states;     // the states living on this node (one per partition)
+    SolverOpts opts;      // how we were set up
+    int mirror;           // states are stored as the one of them and their mirror
+			  // image with the smaller hash (bd.sym, StateSet engines)
+    // HDA* only
+    Mbox *mbox;           // one mailbox per partition (threads)
+    Net *net;             // links to the other nodes (processes)
+    int rsize;            // size of a mailbox record
+    HdaCtl *ctl;          // termination and the solution
+    HdaCtl ctlmem;        // ctl when there is only one process
+    // direct only
+    Direct dt;
+    // bfs only
+    Layers ly;
+    // frontier only (the second is for finding the way back)
+    Frontier fr[2];
+    // disk only
+    Disk dk;
 }; 
 
 
-void solver_init(Solver *sv, Board bd, Iint nstates);
+void solver_init(Solver *sv, Board bd, SolverOpts *opts);
 void solver_fini(Solver *sv);
-void solver_solve(Solver *ks, int nthreads);
-void solver_make_sequence(Solver *ks, StatePtr sp, List *seq);
+void solver_solve(Solver *ks);
+void solver_make_sequence(Solver *ks, int node, StatePtr sp, List *seq);
+int piece_find(u16 p, u16 *pcs, int len);
+Move state_diff_move(Board *bd, u16 *p1, u16 *p2, u16 *perm);
+Iint solver_used(Solver *ks);
 
 #endif
 
@@ -8,32 +8,46 @@
 #include "state.h"
 #include "mem.h"
 
-
-unsigned int APHash(char* str, unsigned int len)
-{
-   unsigned int hash = 0;
-   unsigned int i    = 0;
-
-   for(i = 0; i < len; str++, i++)
-   {
-      hash ^= ((i & 1) == 0) ? (  (hash <<  7) ^ (*str) ^ (hash >> 3)) :
-                               (~((hash << 11) ^ (*str) ^ (hash >> 5)));
-   }
-
-   return hash;
-}
+static RefStats ref_dummy;  // for threads that never called state_thread
+static __thread RefStats *ref_stats = &ref_dummy;
 
 
-/** Create a 32 bit hash from a state
+/** Fold a 64 bit board_hash into a HashVal for the index
  */
-HashVal state_hash(u16 *pcs, int len)
+HashVal state_hash(u64 zh)
 {
-    HashVal h = APHash((char*)pcs, len*2);
+#ifdef WIDE
+    HashVal h = zh;
+#else
+    HashVal h = (HashVal)(zh ^ (zh >> 32));
+#endif
     if(h == 0 || h == ~0)
 	return 1;
     return h;
 }
 
+/** The top SEMI_FPBITS bits of \a zh.  The fold xors them into the top of
+ * the HashVal, but among the states that share a HashVal (the ones on a
+ * chain) they are still spread evenly, so a different fp means a
+ * different state.  (With a WIDE HashVal the chains are only duplicates)
+ */
+static inline int state_fp(u64 zh)
+{
+#ifdef SEMI_FPBITS
+    return zh >> (64 - SEMI_FPBITS);
+#else
+    return 0;
+#endif
+}
+
+/** Which node owns the states that hash to \a hv.
+ * The hash is remixed so the owner is independent of hv%fmod and hv%HASHTBLSIZE
+ */
+static inline int hv_node(StateSet *ss, HashVal hv)
+{
+    return (int)((((unsigned long long)hv * 0x9E3779B97F4A7C15ULL) >> 32) % ss->nnodes);
+}
+
 /** Compare two states for equality
  */
 int state_eq(u16 *s1, u16 *s2, int len)
@@ -45,15 +59,18 @@ int state_eq(u16 *s1, u16 *s2, int len)
     return 1;
 }
 
-StatePtr new_full(StateSet *ss, StateFull *state)
+/** A full state is stored as its header followed by the packed pcs
+ */
+StatePtr new_full(StateSet *ss, StateFull *state, u8 *packed)
 {
     StatePtr fsp;
     StateFull *sf;
     fsp = bm_alloc(&ss->full);
     if(fsp == 0)
-	DIE("Out of full node space");
+	DIE("Out of full node space (%lu Mb committed)", bm_committed() >> 20);
     sf = (StateFull*)bm_ref(&ss->full, fsp);
-    memcpy(sf, state, ss->sizeof_full);
+    memcpy(sf, state, sizeof(StateFull));
+    memcpy(sf->pcs, packed, ss->codec.nbytes);
     return fsp * ss->fmod;
 }
 
@@ -63,7 +80,7 @@ StatePtr new_semi(StateSet *ss, StateFull *state)
     StateSemi *s;
     sp = bm_alloc(&ss->semi);
     if(sp == 0)
-	DIE("Out of semi-node space");
+	DIE("Out of semi-node space (%lu Mb committed)", bm_committed() >> 20);
     s = (StateSemi*)bm_ref(&ss->semi, sp);
     memcpy(s, &state->semi, sizeof(StateSemi));
     return (StatePtr)(((unsigned long long)(sp-1) * ss->fmod) / (ss->fmod-1)) + 1;
@@ -78,48 +95,104 @@ StateSemi *state_ref_semi(StateSet *ss, StatePtr sp)
     }
 }
 
+/** Return a state made by new_full/new_semi that never got linked in
+ */
+static void del_state(StateSet *ss, StatePtr sp)
+{
+    if(sp % ss->fmod)
+	bm_free(&ss->semi, sp - sp / ss->fmod);
+    else
+	bm_free(&ss->full, sp / ss->fmod);
+}
+
 /**
  * Inserts \a state into the pool of states.
  * All fields of \a state should be set.  Set idx_next to zero.
+ * \a zh is board_hash of its pcs (usually kept up to date move by move).
  * This function is tied closely with the index.  (it passes locks back and forth)
+ * New states are linked onto the end of their chain with a CAS, so this works
+ * both under the btree locks and with the lockless INDEX_HASH.
  *
  * RETURN:
  *  -1: Error.  Re-run
  *   0: State unique and inserted
  *   1: State is a duplicate
- *   2: Sent state to another node
+ *   2: State belongs on another node. *spret is that node
  */
-int state_insert(StateSet *ss, Board *bd, StateFull *state, StatePtr *spret)
+int state_insert(StateSet *ss, Board *bd, StateFull *state, u64 zh, StatePtr *spret)
 {
-    HashVal hv = state_hash(state->pcs, ss->npcs); // the all-important hash of this state
+    HashVal hv = state_hash(zh); // the all-important hash of this state
     int wr; // is our lock RW or RO?
+    int eq;
     pthread_rwlock_t *lock; // the index lock
-    u16 *tpcs, *spcs;
-    StatePtr *sp;
+    StatePtr *sp, nsp = 0, cur;
     StateSemi *semi;
-    StateFull *fs = alloca(ss->sizeof_full);
-    // we need some temp piece mem for calculating pcs from semi-states
-    tpcs = alloca(2*ss->npcs);
+    StateFull *fs, *fsbuf = alloca(ss->sizeof_full);
+    u8 *packed = alloca(ss->codec.nbytes);
 
     // Does this state belong on this node?
-    if(hv % ss->nnodes != ss->node) {
-	// Send this state to another node and tell it where its from (us)
-	DIE("Nodes not implemented");
+    if(ss->nnodes > 1 && hv_node(ss, hv) != ss->node) {
+	// The caller sends it to the other node (and tells it where its from)
+	*spret = hv_node(ss, hv);
 	return 2;
     }
 
+    // full states in the chain are compared packed
+    codec_pack(&ss->codec, state->pcs, packed);
+#ifdef SEMI_FPBITS
+    state->semi.fp = state_fp(zh);
+#endif
+
     // Use our index to find a small chain of possibly equal states
     wr = index_ref(&ss->idx, hv, &sp, &lock);
     if(wr < 0) // failed to aquire rw lock.  Abort
 	return -1;
 
     // follow the chain of states that all hash to hv
-    while(*sp) {
-	state_ref(ss, bd, *sp, fs);
-	semi = state_ref_semi(ss, *sp);
+    while(1) {
+	cur = __atomic_load_n(sp, __ATOMIC_ACQUIRE);
+	if(!cur) {
+	    // this is a unique state so add it (need RW to modify index)
+	    if(!index_upgrade_rwlock(&ss->idx, wr, hv%HASHTBLSIZE, lock)) {
+		if(nsp)
+		    del_state(ss, nsp);
+		return -1; // rw lock contention
+	    }
+	    wr = 1;
+	    // We need to decide if we are creating a full-state or semi-state
+	    // Assume a semi-state and upgrade to full-state if nessicary
+	    if(!nsp) {
+		if(state->semi.parent == 0 || !(hv%ss->fdiv) ||
+			(!ss->peers && state->semi.node != ss->node)) {
+		    nsp = new_full(ss, state, packed);
+		} else {
+		    nsp = new_semi(ss, state);
+		}
+	    }
+	    if(__sync_bool_compare_and_swap(sp, 0, nsp))
+		break;
+	    continue; // someone else linked a state here first. check it
+	}
+	semi = state_ref_semi(ss, cur);
+	if(!(cur % ss->fmod)) {
+	    fs = (StateFull*)semi; // only the header and packed pcs are valid
+	    eq = !memcmp(packed, fs->pcs, ss->codec.nbytes);
+	} else {
+	    ref_stats->chained++;
+#ifdef SEMI_FPBITS
+	    if(semi->fp != state->semi.fp) { // no need to replay it
+		ref_stats->skipped++;
+		sp = &semi->idx_next;
+		continue;
+	    }
+#endif
+	    fs = fsbuf;
+	    state_ref(ss, bd, cur, fs);
+	    eq = state_eq(state->pcs, fs->pcs, ss->npcs);
+	}
 
 	// we now have spcs
-	if(state_eq(state->pcs, fs->pcs, ss->npcs)) {
+	if(eq) {
 	    // A full read-only search :-)
 	    if(state->depth < fs->depth) {
 		//DIE("depth short circuit!");
@@ -131,73 +204,239 @@ int state_insert(StateSet *ss, Board *bd, StateFull *state, StatePtr *spret)
 		pthread_mutex_unlock(&ks->alock);
 		*/
 	    }
-	    pthread_rwlock_unlock(lock);
+	    if(nsp)
+		del_state(ss, nsp);
+	    index_unlock(lock);
 	    return 1;
 	}
 	sp = &semi->idx_next;
     }
-    // this is a unique state so add it (need RW to modify index)
-    if(!index_upgrade_rwlock(&ss->idx, wr, hv%HASHTBLSIZE, lock))
-	return -1; // rw lock contention
-    // We need to decide if we are creating a full-state or semi-state
-    // Assume a semi-state and upgrade to full-state if nessicary
-    
-    if(state->semi.parent == 0 || !(hv%ss->fmod)) {
-	*sp = new_full(ss, state);
-    } else {
-	*sp = new_semi(ss, state);
-    }
        
-    *spret = *sp;
+    *spret = nsp;
     // unlock our lock and return
-    pthread_rwlock_unlock(lock);
+    index_unlock(lock);
     return 0;
 }
 
-void state_ref(StateSet *ss, Board *bd, StatePtr sp, StateFull *fs)
+/** state_insert \a n states at once.  Their lookups are walked in step,
+ * STATE_BATCH at a time, so the cache misses down the index and onto the
+ * chain heads overlap instead of queueing up one behind the other.
+ * rets[i] and sps[i] get what state_insert gave for states[i] (never -1).
+ * Returns the number of retries
+ */
+int state_insert_batch(StateSet *ss, Board *bd, StateFull **states, u64 *zh, int n, StatePtr *sps, int *rets)
+{
+    IndexProbe probes[STATE_BATCH];
+    int i, j, m, live, step, oops = 0;
+    StatePtr cur;
+
+    for(i=0; i < n; i += m) {
+	m = n-i < STATE_BATCH ? n-i : STATE_BATCH;
+	for(j=0; j < m; j++) {
+	    HashVal hv = state_hash(zh[i+j]);
+	    if(ss->nnodes > 1 && hv_node(ss, hv) != ss->node)
+		probes[j].at = 0, probes[j].sp = NULL; // state_insert won't look
+	    else
+		index_probe(&ss->idx, &probes[j], hv);
+	}
+	// one level of every lookup per pass (bounded, the probes race writers)
+	for(step=0, live=1; live && step < STATE_BATCH_STEPS; step++)
+	    for(j=0, live=0; j < m; j++)
+		live |= index_step(&ss->idx, &probes[j]);
+	for(j=0; j < m; j++)
+	    if(probes[j].sp && (cur = *probes[j].sp))
+		__builtin_prefetch(state_ref_semi(ss, cur));
+	for(j=0; j < m; j++)
+	    while((rets[i+j] = state_insert(ss, bd, states[i+j], zh[i+j], &sps[i+j])) < 0)
+		oops++;
+    }
+    return oops;
+}
+
+/** Is \a state in \a ss?  \a zh is its board_hash.
+ * The index is walked without locks, so only while nobody inserts into \a ss
+ */
+int state_find(StateSet *ss, Board *bd, StateFull *state, u64 zh)
+{
+    IndexProbe p;
+    StatePtr cur;
+    StateSemi *semi;
+    StateFull *fs = alloca(ss->sizeof_full);
+    u8 *packed = alloca(ss->codec.nbytes);
+
+    index_probe(&ss->idx, &p, state_hash(zh));
+    while(index_step(&ss->idx, &p));
+    if(!p.sp)
+	return 0;
+    codec_pack(&ss->codec, state->pcs, packed);
+    for(cur = *p.sp; cur; cur = semi->idx_next) {
+	semi = state_ref_semi(ss, cur);
+	if(!(cur % ss->fmod)) {
+	    if(!memcmp(packed, ((StateFull*)semi)->pcs, ss->codec.nbytes))
+		return 1;
+	    continue;
+	}
+#ifdef SEMI_FPBITS
+	if(semi->fp != state_fp(zh))
+	    continue;
+#endif
+	state_ref(ss, bd, cur, fs);
+	if(state_eq(state->pcs, fs->pcs, ss->npcs))
+	    return 1;
+    }
+    return 0;
+}
+
+/** A thread's cache of decoded semi states.  Slots are keyed by the
+ * StateSet's semi BlockMem id (unique per state_init) and the StatePtr.
+ */
+typedef struct {
+    u32 id;
+    StatePtr sp;
+} SKey;
+
+static __thread SKey *skey;
+static __thread char *sdata; // 1<<SCACHE_BITS StateFulls
+static __thread int ssize;   // sizeof_full of those
+
+static inline int scache_slot(StatePtr sp)
+{
+    return (u32)(sp * 0x9E3779B1u) >> (32 - SCACHE_BITS);
+}
+
+/** Give the calling thread a state cache and count its state_refs in \a rs.
+ * state_thread(ss, NULL) when the thread is done
+ */
+void state_thread(StateSet *ss, RefStats *rs)
+{
+    free(skey);
+    free(sdata);
+    skey = NULL;
+    sdata = NULL;
+    ref_stats = rs ?: &ref_dummy;
+    if(!rs)
+	return;
+    ssize = ss->sizeof_full;
+    skey = calloc(1 << SCACHE_BITS, sizeof(SKey));
+    sdata = safe_malloc(ssize << SCACHE_BITS);
+}
+
+static void sref(StateSet *ss, Board *bd, StatePtr sp, StateFull *fs)
 {
     StateSemi *s = state_ref_semi(ss, sp);
+    int i = 0;
 
     if(sp%ss->fmod) {
-	state_ref(ss, bd, s->parent, fs);
+	if(skey) { // replay stops at anything we decoded lately
+	    ref_stats->looks++;
+	    i = scache_slot(sp);
+	    if(skey[i].sp == sp && skey[i].id == ss->semi.id) {
+		ref_stats->hits++;
+		memcpy(fs, sdata + i*ssize, ss->sizeof_full);
+		return;
+	    }
+	}
+	// the parent may live on another node
+	sref(ss->peers ? &ss->peers[s->node] : ss, bd, s->parent, fs);
 	fs->depth++;
 	memcpy(&fs->semi, s, sizeof(StateSemi));
 	// now step the pieces forward
 	board_apply_move(bd, fs->pcs, s->ipcs, s->dir);
+	if(s->mirror)
+	    board_mirror(bd, fs->pcs);
+	ref_stats->steps++;
+	if(skey) {
+	    skey[i].id = ss->semi.id;
+	    skey[i].sp = sp;
+	    memcpy(sdata + i*ssize, fs, ss->sizeof_full);
+	}
     } else {
-	memcpy(fs, (StateFull*)s, ss->sizeof_full);
+	memcpy(fs, (StateFull*)s, sizeof(StateFull));
+	codec_unpack(&ss->codec, (u8*)((StateFull*)s)->pcs, fs->pcs);
     }
 }
 
-int state_used(StateSet *ss)
+void state_ref(StateSet *ss, Board *bd, StatePtr sp, StateFull *fs)
+{
+    ref_stats->refs++;
+    sref(ss, bd, sp, fs);
+}
+
+/** Pick how many new states are stored full from what state_ref cost
+ * lately (\a rs).  Long replays buy full states unless memory is short,
+ * short ones give them back.
+ */
+void state_tune(StateSet *ss, RefStats *rs)
 {
-    return ss->full.used + ss->semi.used;
+    float replay = rs->steps / (float)rs->refs;
+    int tight = bm_budget() && bm_committed() > bm_budget() / 4 * 3;
+    if(replay > REPLAY_HI && !tight && ss->fdiv > FDIV_MIN)
+	ss->fdiv /= 2;
+    else if((replay < REPLAY_LO || tight) && ss->fdiv < FDIV_MAX)
+	ss->fdiv *= 2;
 }
 
-void state_init(StateSet *ss, Iint num, int full_fraction, int npcs, int nnodes)
+Iint state_used(StateSet *ss)
 {
-    if(num%full_fraction!=0)
-	DIE("num must be multiple of full_fraction");
-    
-    ss->npcs = npcs;
-    ss->sizeof_full = sizeof(StateFull) + 2*npcs;
+    return bm_used(&ss->full) + bm_used(&ss->semi);
+}
+
+/** \a home is the NUMA home for all of it (-1 to leave it to the threads)
+ */
+void state_init(StateSet *ss, Iint num, int full_fraction, Board *bd, int nnodes, int node, StateSet *peers, int itype, int home)
+{
+    ss->npcs = bd->npcs;
+    ss->sizeof_full = sizeof(StateFull) + 2*bd->npcs;
+    codec_init(&ss->codec, bd);
+    ss->sizeof_rec = (sizeof(StateFull) + ss->codec.nbytes + 3) & ~3;
     ss->shorterr = 0;
+    if(!node) {
+	printf("Full states: %d bytes (%d unpacked), semi states: %lu bytes\n",
+		ss->sizeof_rec, ss->sizeof_full, sizeof(StateSemi));
+	printf("Bytes per state: %.1f (%lu bit pointers)\n",
+		(sizeof(StateSemi)*(full_fraction-1) + ss->sizeof_rec) / (float)full_fraction
+		+ index_mem(itype), 8*sizeof(StatePtr));
+    }
+#ifdef WIDE
+    if((unsigned long long)num * 2 >= 1ULL << SEMI_PBITS)
+	DIE("Too many states for a %d bit parent", SEMI_PBITS);
+#endif
 
     // initilize index
-    index_init(&ss->idx, FANOUT*(num*2.0/FANOUT));
+    index_init(&ss->idx, FANOUT*((2*num + FANOUT-1)/FANOUT), itype, home);
     
-    // initilize MPI (not implemented yet)
+    // initilize node info
     ss->nnodes = nnodes;
-    ss->node = 0;
+    ss->node = node;
+    ss->peers = peers;
 
     // initilize state mem
-    ss->fmod = full_fraction;
-    bm_init(&ss->full, ss->sizeof_full, num / full_fraction);
-    bm_init(&ss->semi, sizeof(StateSemi), num - ss->full.num);
+    // fdiv moves about, so either pool may need room for all of them.
+    // (They are only committed as they fill.)  Without peers the states we
+    // are sent can't point back at their parents so they are full as well.
+    ss->fmod = 2;
+    ss->fdiv = full_fraction;
+    bm_init(&ss->full, ss->sizeof_rec, num);
+    bm_init(&ss->semi, sizeof(StateSemi), num);
+    // new states don't have to queue on the BlockMem locks
+    bm_chunk(&ss->full, BM_CHUNK);
+    bm_chunk(&ss->semi, BM_CHUNK);
+    ss->full.home = ss->semi.home = home;
+}
+
+/** Throw every state away (and the memory they took).  Nobody may be using \a ss
+ */
+void state_clear(StateSet *ss)
+{
+    index_clear(&ss->idx);
+    bm_clear(&ss->full);
+    bm_clear(&ss->semi);
+    ss->shorterr = 0;
 }
 
 void state_fini(StateSet *ss)
 {
+    codec_fini(&ss->codec);
     bm_fini(&ss->full);
     bm_fini(&ss->semi);
     index_fini(&ss->idx);
@@ -7,19 +7,46 @@
 #include "mem.h"
 #include "index.h"
 #include "board.h"
+#include "codec.h"
+
+#define SCACHE_BITS 10   // a thread caches 1<<SCACHE_BITS decoded states
+#define FDIV_MIN 2       // most full states we will store (1 in FDIV_MIN)
+#define FDIV_MAX 64
+#define REPLAY_HI 4.0    // replays per state_ref before we store more full states
+#define REPLAY_LO 1.0    // and before we store fewer
+#define STATE_BATCH 16   // lookups state_insert_batch has in flight
+#define STATE_BATCH_STEPS 32 // index levels it walks them down (at most)
 
 typedef struct s_StateSet StateSet;
 typedef struct s_StateSemi StateSemi;
 typedef struct s_StateFull StateFull;
 
 
+#ifdef WIDE
+#define SEMI_PBITS 40 // bits of StatePtr a parent can have
+
+// idx_next is CASed so it gets a whole word.  The rest share the other one
+struct s_StateSemi {
+    StatePtr idx_next;
+    u64 parent:SEMI_PBITS;
+    u64 node:13;  // node on which the parent is hosted
+    u64 ipcs:8;   // piece that moved from parent
+    u64 dir:2;    // direction piece moved
+    u64 mirror:1; // then the board was flipped (see Solver.mirror)
+};
+#else
+#define SEMI_FPBITS 5 // state_fp bits kept in the spare bits of a StateSemi
+
 struct s_StateSemi {
     u16 dir:2;   // direction piece moved
     u16 ipcs:8; // piece that moved from parent
+    u16 mirror:1; // then the board was flipped (see Solver.mirror)
+    u16 fp:SEMI_FPBITS; // state_fp, to pass over chain entries without replay
     u16 node;    // node on which the parent is hosted
     StatePtr idx_next;
     StatePtr parent;
 };
+#endif
 
 struct s_StateFull {
     struct s_StateSemi semi;
@@ -27,30 +54,51 @@ struct s_StateFull {
     u16 pcs[];
 };
 
+/** What state_ref costs a thread
+ */
+typedef struct {
+    Iint refs;   // calls to state_ref
+    Iint looks;  // semi states looked for in the cache
+    Iint hits;   // and found
+    Iint steps;  // moves replayed
+    Iint chained; // semi states met on index chains
+    Iint skipped; // and passed over on their fingerprint
+} RefStats;
+
 struct s_StateSet {
     int npcs;  // number of pieces in the game
     int sizeof_full;  // since StateFull is a [] this is it's size
+    int sizeof_rec;   // size of a full state as stored (pcs packed by codec)
+    Codec codec;      // packs pcs of the full states we store
     int shorterr; // number of short-path errors
 
     // for multi node processing
     int nnodes; // total number of nodes
     int node;   // the index of our node
+    StateSet *peers; // every node's StateSet if they share our memory (or NULL)
 
     // for indexing our states
     Index idx;                            // index of states based on hash
     
     // We split the states into semi-states and full states
     // Every !(StatePtr%fmod) is a full state  
-    int fmod;    // (1/fmod) * totalstates == fullstates
+    int fmod;    // the full and semi StatePtrs interleave 1 : fmod-1
+    volatile int fdiv; // (1/fdiv) * newstates == new fullstates (state_tune)
     BlockMem semi;   // semi states
     BlockMem full;   // full states
 }; 
 
 void state_ref(StateSet *ss, Board *bd, StatePtr sp, StateFull *fs);
-int state_insert(StateSet *ss, Board *bd, StateFull *fs, StatePtr *sp);
-int state_used(StateSet *ss);
-void state_init(StateSet *ss, StatePtr num, int fullmod, int npcs, int nnodes);
+void state_thread(StateSet *ss, RefStats *rs);
+void state_tune(StateSet *ss, RefStats *rs);
+HashVal state_hash(u64 zh);
+int state_insert(StateSet *ss, Board *bd, StateFull *fs, u64 zh, StatePtr *sp);
+int state_find(StateSet *ss, Board *bd, StateFull *fs, u64 zh);
+int state_insert_batch(StateSet *ss, Board *bd, StateFull **fs, u64 *zh, int n, StatePtr *sps, int *rets);
+Iint state_used(StateSet *ss);
+void state_init(StateSet *ss, StatePtr num, int fullmod, Board *bd, int nnodes, int node, StateSet *peers, int itype, int home);
 void state_fini(StateSet *ss);
+void state_clear(StateSet *ss);
 
 
 
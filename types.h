@@ -2,23 +2,34 @@
 #define TYPES_H
 
 #define CACHE_LINE 64
-#define FANOUT 8
+#ifndef FANOUT
+#define FANOUT 8  // keys per btree node (scons fanout=N, a multiple of 4)
+#endif
 #define HASHTBLSIZE 1023
 
 typedef unsigned int u32;
 typedef unsigned short u16;
 typedef signed short s16;
 typedef unsigned char u8;
-
+typedef unsigned long long u64;
+
+// WIDE (scons wide=1) is for searches past 4G states.  It makes the
+// pointers and hash values 64 bit at the cost of memory per state.
+#ifdef WIDE
+typedef u64 Iptr;         // points into BlockMem
+typedef u64 HashVal;
+#define IFMT "%llu"       // printf an Iptr/Iint
+#else
 typedef u32 Iptr;         // points into BlockMem
+typedef u32 HashVal;
+#define IFMT "%u"
+#endif
 typedef Iptr Iint;        // same size as Iptr but its a number
 typedef Iptr IndexPtr;    // points into Index::nodes/states
 typedef Iptr StatePtr;    // points into States
 
 typedef void*(*ThreadMain)(void *);
 
-typedef u32 HashVal;
-
 typedef struct s_State State;
 typedef struct s_Solver Solver;
 typedef struct s_BlockMem BlockMem;